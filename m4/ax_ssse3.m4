@@ -0,0 +1,26 @@
+AC_DEFUN([CHECK_SSSE3], [
+AC_LANG_PUSH([C++])
+AC_CACHE_CHECK(
+  [whether SSSE3 code can be chosen at run time],
+  [nx_cv_ssse3_dispatch],
+  [AC_LINK_IFELSE(
+    [AC_LANG_PROGRAM(
+      [[#include <tmmintrin.h>
+        __attribute__((target("ssse3"))) __m128i
+        shuffle(__m128i x, __m128i y)
+        {
+            return _mm_shuffle_epi8(x, y);
+        }]],
+      [[__builtin_cpu_init();
+        if (__builtin_cpu_supports("ssse3"))
+        {
+            shuffle(_mm_setzero_si128(), _mm_setzero_si128());
+        }]])],
+    [nx_cv_ssse3_dispatch=yes],
+    [nx_cv_ssse3_dispatch=no])])
+AC_LANG_POP([C++])
+if test "$nx_cv_ssse3_dispatch" = yes; then
+  AC_DEFINE([HAVE_SSSE3_DISPATCH], [1],
+            [Define to 1 if SSSE3 code can be built and chosen at run time.])
+fi
+])
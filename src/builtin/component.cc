@@ -73,12 +73,42 @@ Component::dispatch(const Event& event) const
     event_dispatcher->dispatch(event);
 }
 
+void
+Component::dispatch_batch(const Batch_event& batch) const
+{
+    event_dispatcher->dispatch_batch(batch);
+}
+
 void
 Component::post(const Event& event) const
 {
     event_dispatcher->post(event);
 }
 
+void
+Component::post(Event_ptr event) const
+{
+    event_dispatcher->post(std::move(event));
+}
+
+bool
+Component::is_paused() const
+{
+    return event_dispatcher->is_paused();
+}
+
+void
+Component::when_ready(const boost::function<void()>& resume) const
+{
+    event_dispatcher->when_ready(resume);
+}
+
+bool
+Component::is_high_priority(Event_type type) const
+{
+    return event_dispatcher->get_priority_class(type) == Event_dispatcher::HIGH;
+}
+
 void
 Component::register_event(const Event_name& name) const
 {
@@ -98,6 +128,33 @@ Component::register_handler(const Event_name& event_name,
     }
 }
 
+void
+Component::register_handler(const Event_name& event_name,
+                            const Typed_event_handler& h) const
+{
+    if (!event_dispatcher->register_handler(ctxt->get_name(), event_name, h))
+    {
+        throw runtime_error("Event '" + event_name + "' doesn't exist.");
+    }
+}
+
+void
+Component::register_batch_handler(const Event_name& event_name,
+                                  const Event_handler& h) const
+{
+    if (!event_dispatcher->register_batch_handler(ctxt->get_name(),
+                                                  event_name, h))
+    {
+        throw runtime_error("Event '" + event_name + "' doesn't exist.");
+    }
+}
+
+void
+Component::unregister_handler(const Event_name& event_name) const
+{
+    event_dispatcher->unregister_handler(ctxt->get_name(), event_name);
+}
+
 Component_context::Component_context(const Component_name& name,
                                      const std::string& config_path)
     : name(name),
@@ -19,6 +19,11 @@
 #include "connection-manager.hh"
 
 #include <config.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include <algorithm>
 #include <list>
 #include <sstream>
@@ -29,12 +34,16 @@
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/thread/locks.hpp>
 
 #include "assert.hh"
 #include "component.hh"
 #include "connection.hh"
+#include "epoll-connection.hh"
+#include "errno_exception.hh"
 #include "event-dispatcher.hh"
 #include "new-connection-event.hh"
+#include "reload-event.hh"
 #include "vlog.hh"
 
 #include "kernel.hh"
@@ -49,15 +58,33 @@ namespace bassl = ::boost::asio::ssl;
 
 static Vlog_module lg("connection_manager");
 
-static const std::string conn_t_str[] = { "tcp", "ssl", "ptcp", "pssl" };
+static const std::string conn_t_str[] =
+    { "tcp", "ssl", "ptcp", "pssl", "ptcp-epoll", "unix", "punix", "unknown" };
 
 Connection_manager::Connection_manager(const Component_context* ctxt,
                                        const std::list<std::string>& interfaces)
     : Component(ctxt),
-      interfaces(interfaces)
+      interfaces(interfaces), next_reactor(0), n_acceptors(1),
+      backlog(SOMAXCONN), accept_batch(1), tcp_nodelay(true), ssl_session_cache_size(0),
+      ssl_session_timeout(0), ssl_session_tickets(true), ssl_reload(false),
+      reconnect_enabled(true), min_backoff(0), max_backoff(0),
+      n_handshake_threads(0), handshake_queue_limit(0), handshake_timeout(0),
+      handshake_queue_depth(0), handshakes_refused(0)
 {
 }
 
+Connection_manager::~Connection_manager()
+{
+    handshake_work.reset();
+    handshake_io.stop();
+    handshake_threads.join_all();
+
+    BOOST_FOREACH(const std::string& path, unix_paths)
+    {
+        unlink(path.c_str());
+    }
+}
+
 Component*
 Connection_manager::instantiate(const Component_context* ctxt,
                                 const std::list<std::string>& interfaces)
@@ -77,6 +104,29 @@ Connection_manager::configure()
     port_map[port] = name;
     }
     */
+
+    n_acceptors = ctxt->get_config<std::size_t>("acceptors", 1);
+    backlog = ctxt->get_config<int>("backlog", SOMAXCONN);
+    accept_batch =
+        std::max<std::size_t>(ctxt->get_config<std::size_t>("accept-batch", 16), 1);
+    tcp_nodelay = ctxt->get_config<bool>("tcp-nodelay", true);
+
+    ssl_session_cache_size =
+        ctxt->get_config<long>("ssl-session-cache-size",
+                               SSL_SESSION_CACHE_MAX_SIZE_DEFAULT);
+    ssl_session_timeout = ctxt->get_config<long>("ssl-session-timeout", 300);
+    ssl_session_tickets = ctxt->get_config<bool>("ssl-session-tickets", true);
+    ssl_reload = ctxt->get_config<bool>("ssl-reload-on-sighup", false);
+
+    reconnect_enabled = ctxt->get_config<bool>("reconnect", true);
+    min_backoff = ctxt->get_config<long>("reconnect-min-backoff", 1000);
+    max_backoff = std::max(ctxt->get_config<long>("reconnect-max-backoff", 60000),
+                           min_backoff);
+
+    n_handshake_threads = ctxt->get_config<std::size_t>("handshake-threads", 2);
+    handshake_queue_limit =
+        ctxt->get_config<std::size_t>("handshake-queue-limit", 1024);
+    handshake_timeout = ctxt->get_config<long>("handshake-timeout", 10);
 }
 
 void
@@ -109,14 +159,24 @@ Connection_manager::install()
                 + "\" protocol.");
         }
         */
-        if (type == TCP || type == SSL)
+        if (type == UNIX)
+        {
+            VLOG_DBG(lg, "connecting to unix:%s", host.c_str());
+            connect(type, host, 0, key, cert, cafile);
+        }
+        else if (type == PUNIX)
+        {
+            VLOG_DBG(lg, "listening on punix:%s", host.c_str());
+            listen_unix(host);
+        }
+        else if (type == TCP || type == SSL)
         {
             VLOG_DBG(lg, "connecting to %s:%s:%d:%s:%s:%s",
                      conn_t_str[type].c_str(), host.c_str(), port,
                      key.c_str(), cert.c_str(), cafile.c_str());
             connect(type, host, port, key, cert, cafile);
         }
-        else if (type == PTCP || type == PSSL)
+        else if (type == PTCP || type == PSSL || type == PTCP_EPOLL)
         {
             VLOG_DBG(lg, "listening on %s:%s:%d:%s:%s:%s",
                      conn_t_str[type].c_str(), host.c_str(), port,
@@ -130,6 +190,12 @@ Connection_manager::install()
         }
     }
 
+    if (ssl_reload && !ssl_servers.empty())
+    {
+        register_handler<Reload_event>(
+            boost::bind(&Connection_manager::handle_reload, this, _1));
+    }
+
     //throw std::runtime_error("ssl connection name not in the form ssl:HOST:[PORT]:KEY:CERT:CAFILE");
     //throw std::runtime_error("ptcp connection name not in a form like ptcp:[IP]:[PORT]");
     //throw std::runtime_error("pssl connection name not in a form like pssl:[IP]:[PORT]:KEY:CERT:CAFILE");
@@ -167,6 +233,18 @@ Connection_manager::parse(const std::string& interface,
             type = PTCP;
         else if (tokens[0] == "pssl")
             type = PSSL;
+        else if (tokens[0] == "ptcp-epoll")
+            type = PTCP_EPOLL;
+        else if (tokens[0] == "unix" || tokens[0] == "punix")
+        {
+            // the rest is a path, which may hold colons of its own
+            type = tokens[0] == "unix" ? UNIX : PUNIX;
+            host = interface.substr(tokens[0].size() + 1);
+            if (host.empty())
+                throw std::runtime_error(interface
+                                         + ": socket path missing");
+            return;
+        }
 
         if (ntokens == 2)
         {
@@ -189,6 +267,19 @@ Connection_manager::parse(const std::string& interface,
     }
 }
 
+/* With 'nodelay', write small OpenFlow messages right away over TCP,
+ * rather than let Nagle hold them back waiting for an ACK */
+static void
+set_options(tcp_socket::lowest_layer_type& socket, bool nodelay)
+{
+    socket.set_option(baip::tcp::no_delay(nodelay));
+}
+
+static void
+set_options(unix_socket::lowest_layer_type&, bool)
+{
+}
+
 template <typename Async_stream>
 void
 Connection_manager::handle_connect(boost::shared_ptr<Async_stream> socket,
@@ -204,6 +295,20 @@ Connection_manager::handle_connect(boost::shared_ptr<Async_stream> socket,
         return;
     }
 
+    serve(socket);
+}
+
+template <typename Async_stream>
+void
+Connection_manager::serve(boost::shared_ptr<Async_stream> socket)
+{
+    dispatch(New_connection_event(make_connection(socket)));
+}
+
+template <typename Async_stream>
+boost::shared_ptr<Connection>
+Connection_manager::make_connection(boost::shared_ptr<Async_stream> socket)
+{
     // resolve the handler component based on port number
     // either the local or remote port is known to us
     /*
@@ -217,16 +322,15 @@ Connection_manager::handle_connect(boost::shared_ptr<Async_stream> socket,
     */
 
     // create the connection helper class
-    baip::tcp::no_delay nodelay(true);
-    socket->lowest_layer().set_option(nodelay);
+    set_options(socket->lowest_layer(), tcp_nodelay);
     boost::shared_ptr<Connection> connection(
         new Stream_connection<Async_stream>(socket));
 
     VLOG_WARN(lg, "connected: %s", connection->to_string().c_str());
 
-    dispatch(New_connection_event(connection));
     // register the connection with protocol-specific connection handler
     //ch->register_connection(connection);
+    return connection;
 }
 
 void
@@ -251,15 +355,30 @@ Connection_manager::connect(Conn_t type,
                             const std::string& cert,
                             const std::string& cafile)
 {
-    ba::io_service& io = event_dispatcher->get_io_service();
-
-    baip::tcp::endpoint peer(baip::address::from_string(host), port);
+    ba::io_service& io = event_dispatcher->next_io_service();
 
-    Listen_callback cb;
+    boost::shared_ptr<Peer> peer(new Peer(io));
+    peer->type = type;
+    std::stringstream ss;
+    if (type == UNIX)
+    {
+        peer->path = ba::local::stream_protocol::endpoint(host);
+        ss << conn_t_str[type] << ":" << host;
+    }
+    else
+    {
+        peer->endpoint =
+            baip::tcp::endpoint(baip::address::from_string(host), port);
+        ss << conn_t_str[type] << ":" << peer->endpoint;
+    }
+    peer->name = ss.str();
+    peer->failures = 0;
+    peer->seed = time(0) ^ (uintptr_t(peer.get()) >> 4);
 
     if (type == SSL)
     {
-        bassl::context ssl_context(io, bassl::context::sslv23);
+        peer->ssl_context.reset(new bassl::context(io, bassl::context::sslv23));
+        bassl::context& ssl_context = *peer->ssl_context;
         ssl_context.set_options(bassl::context::default_workarounds
                                 | bassl::context::no_sslv2);
         ssl_context.set_verify_mode(
@@ -269,28 +388,142 @@ Connection_manager::connect(Conn_t type,
         ssl_context.load_verify_file(cafile);
         ssl_context.use_certificate_file(cert, bassl::context::pem);
         ssl_context.use_private_key_file(key, bassl::context::pem);
+    }
 
-        boost::shared_ptr<ssl_socket> socket(new ssl_socket(io, ssl_context));
-        socket->lowest_layer().async_connect(peer,
-                                             boost::bind(&Connection_manager::handle_handshake,
-                                                         this, bassl::stream_base::client, socket, cb, _1));
+    peers.push_back(peer);
+    connect(peer);
+}
+
+void
+Connection_manager::connect(boost::shared_ptr<Peer> peer)
+{
+    ba::io_service& io = event_dispatcher->next_io_service();
+
+    if (peer->type == SSL)
+    {
+        boost::shared_ptr<ssl_socket> socket(
+            new ssl_socket(io, *peer->ssl_context));
+        socket->lowest_layer().async_connect(peer->endpoint,
+                                             boost::bind(&Connection_manager::handle_client_connect,
+                                                         this, peer, socket, _1));
     }
-    else if (type == TCP)
+    else if (peer->type == TCP)
     {
         boost::shared_ptr<tcp_socket> socket(new tcp_socket(io));
-        socket->async_connect(peer,
-                              boost::bind(&Connection_manager::handle_connect<tcp_socket>,
-                                          this, socket, cb, _1));
+        socket->async_connect(peer->endpoint,
+                              boost::bind(&Connection_manager::handle_connected<tcp_socket>,
+                                          this, peer, socket, _1));
+    }
+    else if (peer->type == UNIX)
+    {
+        boost::shared_ptr<unix_socket> socket(new unix_socket(io));
+        socket->async_connect(peer->path,
+                              boost::bind(&Connection_manager::handle_connected<unix_socket>,
+                                          this, peer, socket, _1));
     }
 }
 
+void
+Connection_manager::handle_client_connect(boost::shared_ptr<Peer> peer,
+                                          boost::shared_ptr<ssl_socket> socket,
+                                          const boost::system::error_code& ec)
+{
+    if (ec)
+    {
+        handle_connected(peer, socket, ec);
+        return;
+    }
+
+    socket->async_handshake(bassl::stream_base::client,
+                            boost::bind(&Connection_manager::handle_connected<ssl_socket>,
+                                        this, peer, socket, _1));
+}
+
+template <typename Async_stream>
+void
+Connection_manager::handle_connected(boost::shared_ptr<Peer> peer,
+                                     boost::shared_ptr<Async_stream> socket,
+                                     const boost::system::error_code& ec)
+{
+    if (ec == ba::error::operation_aborted)
+    {
+        return;
+    }
+    if (ec)
+    {
+        VLOG_WARN(lg, "cannot connect to %s: %s", peer->name.c_str(),
+                  ec.message().c_str());
+        reconnect(peer);
+        return;
+    }
+
+    peer->connected_at = boost::posix_time::microsec_clock::universal_time();
+    boost::shared_ptr<Connection> connection = make_connection(socket);
+    connection->set_close_hook(
+        boost::bind(&Connection_manager::reconnect, this, peer));
+    dispatch(New_connection_event(connection));
+}
+
+void
+Connection_manager::reconnect(boost::shared_ptr<Peer> peer)
+{
+    if (!reconnect_enabled)
+    {
+        VLOG_WARN(lg, "lost %s, not reconnecting", peer->name.c_str());
+        return;
+    }
+
+    // Only a session that stayed up longer than the longest backoff starts
+    // it over: a peer that accepts and drops right away is still backed
+    // off from
+    if (!peer->connected_at.is_not_a_date_time())
+    {
+        const boost::posix_time::time_duration up =
+            boost::posix_time::microsec_clock::universal_time()
+            - peer->connected_at;
+        if (up >= boost::posix_time::milliseconds(max_backoff))
+        {
+            peer->failures = 0;
+        }
+        peer->connected_at = boost::posix_time::not_a_date_time;
+    }
+
+    // Wait between half and all of the backoff, picked at random
+    long backoff = min_backoff;
+    for (unsigned i = 0; i < peer->failures && backoff < max_backoff; i++)
+    {
+        backoff *= 2;
+    }
+    backoff = std::min(backoff, max_backoff);
+    const long delay = backoff / 2 + rand_r(&peer->seed) % (backoff / 2 + 1);
+    peer->failures++;
+
+    VLOG_WARN(lg, "reconnecting to %s in %ld ms", peer->name.c_str(), delay);
+    peer->timer.expires_from_now(boost::posix_time::milliseconds(delay));
+    peer->timer.async_wait(boost::bind(&Connection_manager::handle_backoff,
+                                       this, peer, _1));
+}
+
+void
+Connection_manager::handle_backoff(boost::shared_ptr<Peer> peer,
+                                   const boost::system::error_code& ec)
+{
+    if (ec)
+    {
+        return;
+    }
+    connect(peer);
+}
+
 void
 Connection_manager::listen(boost::shared_ptr<boost::asio::ip::tcp::acceptor> acceptor)
 {
-    ba::io_service& io = acceptor->get_io_service();
+    // accept into a socket of the next shard, which the connection then
+    // stays on
+    ba::io_service& io = event_dispatcher->next_io_service();
 
-    Listen_callback cb(
-        boost::bind(&Connection_manager::listen, this, acceptor));
+    Listen_callback cb(boost::bind(&Connection_manager::accept_pending,
+                                   this, acceptor, PTCP));
     boost::shared_ptr<tcp_socket> socket(new tcp_socket(io));
     acceptor->async_accept(socket->lowest_layer(),
                            boost::bind(&Connection_manager::handle_connect<tcp_socket>,
@@ -299,33 +532,341 @@ Connection_manager::listen(boost::shared_ptr<boost::asio::ip::tcp::acceptor> acc
 
 void
 Connection_manager::listen(boost::shared_ptr<boost::asio::ip::tcp::acceptor> acceptor,
-                           const std::string& key,
-                           const std::string& cert,
-                           const std::string& cafile)
+                           boost::shared_ptr<Ssl_server> server)
 {
     Listen_callback cb(boost::bind(&Connection_manager::listen, this,
-                                   acceptor, key, cert, cafile));
+                                   acceptor, server));
+
+    ba::io_service& io = event_dispatcher->next_io_service();
+
+    boost::shared_ptr<bassl::context> ssl_context;
+    {
+        boost::lock_guard<boost::mutex> lock(server->mutex);
+        ssl_context = server->context;
+    }
 
-    ba::io_service& io = acceptor->get_io_service();
+    // The stream holds its own reference to the underlying SSL_CTX, so a
+    // reload does not pull the context from under open connections
+    boost::shared_ptr<ssl_socket> socket(new ssl_socket(io, *ssl_context));
+    if (n_handshake_threads > 0)
+    {
+        acceptor->async_accept(socket->lowest_layer(),
+                               boost::bind(&Connection_manager::handle_accept_ssl,
+                                           this, socket, cb, _1));
+    }
+    else
+    {
+        acceptor->async_accept(socket->lowest_layer(),
+                               boost::bind(&Connection_manager::handle_handshake,
+                                           this, bassl::stream_base::server, socket, cb, _1));
+    }
+}
 
-    bassl::context ssl_context(io, bassl::context::sslv23);
-    ssl_context.set_options(bassl::context::default_workarounds
-                            | bassl::context::no_sslv2);
-    ssl_context.set_verify_mode(
+void
+Connection_manager::handle_accept_ssl(boost::shared_ptr<ssl_socket> socket,
+                                      Listen_callback cb,
+                                      const boost::system::error_code& ec)
+{
+    // Accept the next connection right away, not once this one's
+    // handshake is done
+    if (ec != ba::error::operation_aborted)
+    {
+        cb();
+    }
+    if (ec)
+    {
+        return;
+    }
+
+    const std::size_t depth = handshake_queue_depth++;
+    if (depth >= handshake_queue_limit)
+    {
+        --handshake_queue_depth;
+        ++handshakes_refused;
+        VLOG_WARN(lg, "%zu handshakes pending, refusing connection",
+                  depth);
+        return;
+    }
+    VLOG_DBG(lg, "%zu handshakes pending", depth + 1);
+
+    boost::shared_ptr<Handshake> hs(new Handshake(handshake_io));
+    hs->strand.post(boost::bind(&Connection_manager::handshake,
+                                this, hs, socket));
+}
+
+void
+Connection_manager::handshake(boost::shared_ptr<Handshake> hs,
+                              boost::shared_ptr<ssl_socket> socket)
+{
+    if (handshake_timeout > 0)
+    {
+        hs->timer.expires_from_now(
+            boost::posix_time::seconds(handshake_timeout));
+        hs->timer.async_wait(
+            hs->strand.wrap(
+                boost::bind(&Connection_manager::handle_handshake_deadline,
+                            this, hs, socket, _1)));
+    }
+
+    // The handshake's intermediate handlers run as its completion handler
+    // does, on the strand, so no handshake step runs on the event loop
+    socket->async_handshake(
+        bassl::stream_base::server,
+        hs->strand.wrap(
+            boost::bind(&Connection_manager::handle_server_handshake,
+                        this, hs, socket, _1)));
+}
+
+void
+Connection_manager::handle_server_handshake(boost::shared_ptr<Handshake> hs,
+                                            boost::shared_ptr<ssl_socket> socket,
+                                            const boost::system::error_code& ec_)
+{
+    bs::error_code ec = ec_;
+    if (hs->state == Handshake::EXPIRED)
+    {
+        ec = ba::error::timed_out;
+    }
+    hs->state = Handshake::DONE;
+    bs::error_code ignored;
+    hs->timer.cancel(ignored);
+    --handshake_queue_depth;
+
+    if (ec)
+    {
+        VLOG_WARN(lg, "handshake failed: %s", ec.message().c_str());
+        return;
+    }
+
+    // From now on the connection is served by the shard it was accepted on
+    socket->get_io_service().post(
+        boost::bind(&Connection_manager::serve<ssl_socket>, this, socket));
+}
+
+void
+Connection_manager::handle_handshake_deadline(boost::shared_ptr<Handshake> hs,
+                                              boost::shared_ptr<ssl_socket> socket,
+                                              const boost::system::error_code& ec)
+{
+    if (ec || hs->state != Handshake::PENDING)
+    {
+        return;
+    }
+
+    // Fail the pending read or write, and any the handshake would start
+    VLOG_WARN(lg, "handshake timed out after %ld s", handshake_timeout);
+    hs->state = Handshake::EXPIRED;
+    bs::error_code ignored;
+    socket->lowest_layer().close(ignored);
+}
+
+boost::shared_ptr<bassl::context>
+Connection_manager::load_ssl_context(const Ssl_server& server)
+{
+    ba::io_service& io = event_dispatcher->get_io_service();
+
+    boost::shared_ptr<bassl::context> ssl_context(
+        new bassl::context(io, bassl::context::sslv23));
+    ssl_context->set_options(bassl::context::default_workarounds
+                             | bassl::context::no_sslv2);
+    ssl_context->set_verify_mode(
         bassl::context::verify_peer |
         bassl::context::verify_fail_if_no_peer_cert |
         bassl::context::verify_client_once);
-    if (!cafile.empty())
-        ssl_context.load_verify_file(cafile);
-    if (!cert.empty())
-        ssl_context.use_certificate_file(cert, bassl::context::pem);
-    if (!key.empty())
-        ssl_context.use_private_key_file(key, bassl::context::pem);
+    if (!server.cafile.empty())
+        ssl_context->load_verify_file(server.cafile);
+    if (!server.cert.empty())
+        ssl_context->use_certificate_file(server.cert, bassl::context::pem);
+    if (!server.key.empty())
+        ssl_context->use_private_key_file(server.key, bassl::context::pem);
+
+    // Let reconnecting switches resume their session rather than go
+    // through a full handshake.  Sessions of peers whose certificate was
+    // verified are only resumed within the same session id context.
+    static const unsigned char session_id_context[] = "nox";
+    SSL_CTX* ctx = ssl_context->impl();
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, session_id_context,
+                                   sizeof session_id_context - 1);
+    SSL_CTX_sess_set_cache_size(ctx, ssl_session_cache_size);
+    SSL_CTX_set_timeout(ctx, ssl_session_timeout);
+    if (!ssl_session_tickets)
+    {
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    }
 
-    boost::shared_ptr<ssl_socket> socket(new ssl_socket(io, ssl_context));
-    acceptor->async_accept(socket->lowest_layer(),
-                           boost::bind(&Connection_manager::handle_handshake,
-                                       this, bassl::stream_base::server, socket, cb, _1));
+    return ssl_context;
+}
+
+Disposition
+Connection_manager::handle_reload(const Event&)
+{
+    BOOST_FOREACH(const boost::shared_ptr<Ssl_server>& server, ssl_servers)
+    {
+        try
+        {
+            boost::shared_ptr<bassl::context> ssl_context =
+                load_ssl_context(*server);
+            boost::lock_guard<boost::mutex> lock(server->mutex);
+            server->context = ssl_context;
+            VLOG_WARN(lg, "reloaded SSL context (%s, %s, %s)",
+                      server->key.c_str(), server->cert.c_str(),
+                      server->cafile.c_str());
+        }
+        catch (const std::exception& e)
+        {
+            // keep serving with the previous files
+            VLOG_ERR(lg, "cannot reload SSL context (%s, %s, %s): %s",
+                     server->key.c_str(), server->cert.c_str(),
+                     server->cafile.c_str(), e.what());
+        }
+    }
+
+    return CONTINUE;
+}
+
+void
+Connection_manager::accept_unix(boost::shared_ptr<ba::local::stream_protocol::acceptor> acceptor)
+{
+    ba::io_service& io = event_dispatcher->next_io_service();
+
+    Listen_callback cb(
+        boost::bind(&Connection_manager::accept_unix, this, acceptor));
+    boost::shared_ptr<unix_socket> socket(new unix_socket(io));
+    acceptor->async_accept(*socket,
+                           boost::bind(&Connection_manager::handle_connect<unix_socket>,
+                                       this, socket, cb, _1));
+}
+
+void
+Connection_manager::listen_unix(const std::string& path)
+{
+    // A socket left behind by an earlier run would fail the bind; anything
+    // else at the path is left alone, and fails it
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+        {
+            throw std::runtime_error("punix:" + path +
+                                     ": path exists and is not a socket");
+        }
+        unlink(path.c_str());
+    }
+
+    ba::local::stream_protocol::endpoint endpoint(path);
+    boost::shared_ptr<ba::local::stream_protocol::acceptor> acceptor(
+        new ba::local::stream_protocol::acceptor(
+            event_dispatcher->get_io_service()));
+    acceptor->open(endpoint.protocol());
+    acceptor->bind(endpoint);
+    acceptor->listen(backlog);
+    unix_paths.push_back(path);
+
+    accept_unix(acceptor);
+}
+
+void
+Connection_manager::listen_epoll(boost::shared_ptr<boost::asio::ip::tcp::acceptor> acceptor)
+{
+    Listen_callback cb(boost::bind(&Connection_manager::accept_pending,
+                                   this, acceptor, PTCP_EPOLL));
+    boost::shared_ptr<tcp_socket> socket(
+        new tcp_socket(event_dispatcher->get_io_service()));
+    acceptor->async_accept(*socket,
+                           boost::bind(&Connection_manager::handle_accept_epoll,
+                                       this, socket, cb, _1));
+}
+
+void
+Connection_manager::handle_accept_epoll(boost::shared_ptr<tcp_socket> socket,
+                                        Listen_callback cb,
+                                        const boost::system::error_code& ec)
+{
+    if (ec != ba::error::operation_aborted)
+    {
+        cb();
+    }
+    if (ec)
+    {
+        return;
+    }
+
+    serve_epoll(socket);
+}
+
+void
+Connection_manager::serve_epoll(boost::shared_ptr<tcp_socket> socket)
+{
+    // Hand the descriptor over to a reactor, round robin; the options set
+    // on the socket stay with it
+    set_options(socket->lowest_layer(), tcp_nodelay);
+    int fd = dup(socket->native());
+    bs::error_code ignored;
+    socket->close(ignored);
+    if (fd < 0)
+    {
+        VLOG_WARN(lg, "cannot take over accepted socket: %s", strerror(errno));
+        return;
+    }
+
+    Epoll_reactor& reactor = reactors[next_reactor++ % reactors.size()];
+    boost::shared_ptr<Epoll_connection> connection(
+        new Epoll_connection(reactor, fd));
+    try
+    {
+        reactor.add(connection);
+    }
+    catch (const std::exception& e)
+    {
+        VLOG_WARN(lg, "cannot serve connection: %s", e.what());
+        return;
+    }
+
+    VLOG_WARN(lg, "connected: %s", connection->to_string().c_str());
+
+    dispatch(New_connection_event(connection));
+}
+
+void
+Connection_manager::accept_pending(boost::shared_ptr<baip::tcp::acceptor> acceptor,
+                                   Conn_t type)
+{
+    // Under a reconnect storm more connections queue up behind the one
+    // just accepted: take them without a trip through the event loop
+    for (std::size_t i = 1; i < accept_batch; i++)
+    {
+        boost::shared_ptr<tcp_socket> socket(
+            new tcp_socket(event_dispatcher->next_io_service()));
+        bs::error_code ec;
+        acceptor->accept(*socket, ec);
+        if (ec)
+        {
+            if (ec != ba::error::would_block && ec != ba::error::try_again)
+            {
+                VLOG_WARN(lg, "accept failed: %s", ec.message().c_str());
+            }
+            break;
+        }
+
+        if (type == PTCP_EPOLL)
+        {
+            serve_epoll(socket);
+        }
+        else
+        {
+            serve(socket);
+        }
+    }
+
+    if (type == PTCP_EPOLL)
+    {
+        listen_epoll(acceptor);
+    }
+    else
+    {
+        listen(acceptor);
+    }
 }
 
 void
@@ -335,19 +876,92 @@ Connection_manager::listen(Conn_t type,
                            const std::string& cert,
                            const std::string& cafile)
 {
-    ba::io_service& io = event_dispatcher->get_io_service();
+    baip::tcp::endpoint endpoint(baip::address::from_string(bind_ip), port);
 
-    baip::address bind_address(baip::address::from_string(bind_ip));
-    boost::shared_ptr<baip::tcp::acceptor> acceptor(new baip::tcp::acceptor(
-                                                        io, baip::tcp::endpoint(bind_address, port)));
+    std::size_t n = n_acceptors ? n_acceptors : event_dispatcher->get_n_threads();
+#ifndef SO_REUSEPORT
+    if (n > 1)
+    {
+        VLOG_WARN(lg, "SO_REUSEPORT is not supported, "
+                  "listening on %s with a single acceptor", bind_ip.c_str());
+        n = 1;
+    }
+#endif
 
+    boost::shared_ptr<Ssl_server> server;
     if (type == PSSL)
     {
-        listen(acceptor, key, cert, cafile);
+        server.reset(new Ssl_server);
+        server->key = key;
+        server->cert = cert;
+        server->cafile = cafile;
+        server->context = load_ssl_context(*server);
+        ssl_servers.push_back(server);
+
+        if (n_handshake_threads > 0 && !handshake_work)
+        {
+            handshake_work.reset(new ba::io_service::work(handshake_io));
+            for (std::size_t i = 0; i < n_handshake_threads; i++)
+            {
+                handshake_threads.create_thread(
+                    boost::bind(static_cast<std::size_t (ba::io_service::*)()>(
+                                    &ba::io_service::run), &handshake_io));
+            }
+        }
     }
-    else if (type == PTCP)
+    else if (type == PTCP_EPOLL)
     {
-        listen(acceptor);
+        for (std::size_t i = reactors.size();
+             i < event_dispatcher->get_n_threads(); i++)
+        {
+            reactors.push_back(new Epoll_reactor);
+        }
+    }
+
+    for (std::size_t i = 0; i < n; i++)
+    {
+        // Several acceptors are spread over the shards, the kernel then
+        // balancing new connections between them
+        ba::io_service& io = n > 1 ? event_dispatcher->next_io_service()
+                                   : event_dispatcher->get_io_service();
+
+        boost::shared_ptr<baip::tcp::acceptor> acceptor(
+            new baip::tcp::acceptor(io));
+        acceptor->open(endpoint.protocol());
+        acceptor->set_option(baip::tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+        if (n > 1)
+        {
+            int on = 1;
+            if (setsockopt(acceptor->native(), SOL_SOCKET, SO_REUSEPORT,
+                           &on, sizeof on) < 0)
+            {
+                throw errno_exception(errno, "setsockopt(SO_REUSEPORT)");
+            }
+        }
+#endif
+        acceptor->bind(endpoint);
+        acceptor->listen(backlog);
+
+        if (type == PSSL)
+        {
+            listen(acceptor, server);
+            continue;
+        }
+
+        if (accept_batch > 1)
+        {
+            ba::socket_base::non_blocking_io non_blocking_io(true);
+            acceptor->io_control(non_blocking_io);
+        }
+        if (type == PTCP)
+        {
+            listen(acceptor);
+        }
+        else if (type == PTCP_EPOLL)
+        {
+            listen_epoll(acceptor);
+        }
     }
 }
 
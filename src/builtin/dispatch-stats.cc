@@ -0,0 +1,513 @@
+/* Copyright 2008 (C) Nicira, Inc.
+ *
+ * This file is part of NOX.
+ *
+ * NOX is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NOX is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NOX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "dispatch-stats.hh"
+
+#include <inttypes.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <istream>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "string.hh"
+#include "vlog.hh"
+
+namespace vigil
+{
+
+namespace ba = ::boost::asio;
+namespace bs = ::boost::system;
+
+static Vlog_module lg("dispatch-stats");
+
+/* Counters of one event type or handler, in one shard.  Only the thread
+ * owning the shard writes them, so updates need no atomic read-modify-write;
+ * the atomics only make the concurrent reads of report() well defined. */
+class Dispatch_stats::Counters
+{
+public:
+    /* Latency histogram with four buckets per power of two, i.e. two
+     * significant bits of precision in the manner of an HDR histogram,
+     * covering up to 2^40 ns. */
+    static const unsigned N_BUCKETS = 160;
+
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> stops;
+    std::atomic<uint64_t> exceptions;
+    std::atomic<uint64_t> total_ns;
+    std::atomic<uint64_t> max_ns;
+    std::atomic<uint64_t> buckets[N_BUCKETS];
+
+    Counters()
+    {
+        count = stops = exceptions = total_ns = max_ns = 0;
+        for (unsigned i = 0; i < N_BUCKETS; i++)
+        {
+            buckets[i] = 0;
+        }
+    }
+
+    static void inc(std::atomic<uint64_t>& c, uint64_t n = 1)
+    {
+        c.store(c.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+    }
+
+    static unsigned bucket(uint64_t ns)
+    {
+        if (ns < 4)
+        {
+            return ns;
+        }
+        unsigned msb = 63 - __builtin_clzll(ns);
+        unsigned i = ((msb - 1) << 2) | ((ns >> (msb - 2)) & 3);
+        return std::min(i, N_BUCKETS - 1);
+    }
+
+    /* Smallest latency falling in bucket 'i' */
+    static uint64_t bucket_floor(unsigned i)
+    {
+        if (i < 4)
+        {
+            return i;
+        }
+        unsigned msb = (i >> 2) + 1;
+        return uint64_t(4 | (i & 3)) << (msb - 2);
+    }
+
+    void record(uint64_t ns, Disposition d, uint64_t n)
+    {
+        inc(count, n);
+        inc(total_ns, ns);
+        inc(buckets[bucket(ns)]);
+        if (d == STOP)
+        {
+            inc(stops);
+        }
+        if (ns > max_ns.load(std::memory_order_relaxed))
+        {
+            max_ns.store(ns, std::memory_order_relaxed);
+        }
+    }
+};
+
+class Dispatch_stats::Shard
+{
+public:
+    std::atomic<Counters*> events[Event::MAX_TYPES];
+    std::atomic<Counters*> handlers[MAX_HANDLERS];
+
+    Shard()
+    {
+        for (std::size_t i = 0; i < Event::MAX_TYPES; i++)
+        {
+            events[i] = 0;
+        }
+        for (std::size_t i = 0; i < MAX_HANDLERS; i++)
+        {
+            handlers[i] = 0;
+        }
+    }
+
+    ~Shard()
+    {
+        for (std::size_t i = 0; i < Event::MAX_TYPES; i++)
+        {
+            delete events[i].load();
+        }
+        for (std::size_t i = 0; i < MAX_HANDLERS; i++)
+        {
+            delete handlers[i].load();
+        }
+    }
+
+    /* Counters are allocated on first use, by the owning thread. */
+    static Counters& get(std::atomic<Counters*>& slot)
+    {
+        Counters* c = slot.load(std::memory_order_relaxed);
+        if (!c)
+        {
+            c = new Counters;
+            slot.store(c, std::memory_order_release);
+        }
+        return *c;
+    }
+};
+
+/* Shards outlive their threads: they are owned by Dispatch_stats. */
+void
+Dispatch_stats::leave_shard(Shard*)
+{
+}
+
+Dispatch_stats::Dispatch_stats()
+    : local_shard(&leave_shard),
+      queue_depth(0), max_queue_depth(0)
+{
+}
+
+Dispatch_stats::~Dispatch_stats()
+{
+    BOOST_FOREACH(Shard* shard, shards)
+    {
+        delete shard;
+    }
+}
+
+std::size_t
+Dispatch_stats::add_handler(const Event_name& event, const std::string& owner)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    if (handler_names.size() >= MAX_HANDLERS)
+    {
+        return MAX_HANDLERS;
+    }
+    handler_names.push_back(event + " " + owner);
+    return handler_names.size() - 1;
+}
+
+Dispatch_stats::Shard&
+Dispatch_stats::get_shard()
+{
+    Shard* shard = local_shard.get();
+    if (!shard)
+    {
+        shard = new Shard;
+        local_shard.reset(shard);
+        boost::lock_guard<boost::mutex> lock(mutex);
+        shards.push_back(shard);
+    }
+    return *shard;
+}
+
+void
+Dispatch_stats::record_event(Event_type type, uint64_t ns, Disposition d,
+                             std::size_t n)
+{
+    Shard::get(get_shard().events[type]).record(ns, d, n);
+}
+
+void
+Dispatch_stats::record_handler(Event_type type, std::size_t id, uint64_t ns,
+                               Disposition d, bool leaked)
+{
+    if (id >= MAX_HANDLERS)
+    {
+        return;
+    }
+
+    Shard& shard = get_shard();
+    Shard::get(shard.handlers[id]).record(ns, d, 1);
+    if (leaked)
+    {
+        Counters::inc(Shard::get(shard.handlers[id]).exceptions);
+        Counters::inc(Shard::get(shard.events[type]).exceptions);
+    }
+}
+
+namespace
+{
+
+/* Counters summed over the shards */
+struct Totals
+{
+    uint64_t count;
+    uint64_t stops;
+    uint64_t exceptions;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    std::vector<uint64_t> buckets;
+};
+
+} // unnamed namespace
+
+template <typename Counters>
+static bool
+sum(const std::vector<Counters*>& counters, Totals& t, unsigned n_buckets)
+{
+    t.count = t.stops = t.exceptions = t.total_ns = t.max_ns = 0;
+    t.buckets.assign(n_buckets, 0);
+    BOOST_FOREACH(const Counters* c, counters)
+    {
+        t.count += c->count.load(std::memory_order_relaxed);
+        t.stops += c->stops.load(std::memory_order_relaxed);
+        t.exceptions += c->exceptions.load(std::memory_order_relaxed);
+        t.total_ns += c->total_ns.load(std::memory_order_relaxed);
+        t.max_ns = std::max(t.max_ns,
+                            c->max_ns.load(std::memory_order_relaxed));
+        for (unsigned i = 0; i < n_buckets; i++)
+        {
+            t.buckets[i] += c->buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+    return t.count > 0;
+}
+
+/* Latency at 'quantile', from the bucket holding it */
+template <typename Counters>
+static uint64_t
+percentile(const Totals& t, double quantile)
+{
+    uint64_t rank = uint64_t(quantile * (t.count - 1)) + 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < t.buckets.size(); i++)
+    {
+        seen += t.buckets[i];
+        if (seen >= rank)
+        {
+            return Counters::bucket_floor(i);
+        }
+    }
+    return t.max_ns;
+}
+
+template <typename Counters>
+static std::string
+format(const std::string& name, const Totals& t)
+{
+    return string_format("%-48s %10" PRIu64 " %8" PRIu64 " %6" PRIu64
+                         " %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                         name.c_str(), t.count, t.stops, t.exceptions,
+                         t.total_ns / 1000.0 / t.count,
+                         percentile<Counters>(t, 0.5) / 1000.0,
+                         percentile<Counters>(t, 0.99) / 1000.0,
+                         percentile<Counters>(t, 0.999) / 1000.0,
+                         t.max_ns / 1000.0);
+}
+
+void
+Dispatch_stats::add_section(const std::string& title, const Section& section)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    sections.push_back(std::make_pair(title, section));
+}
+
+std::string
+Dispatch_stats::report() const
+{
+    std::string s = counters_report();
+
+    // Rendered without the lock, as sections take locks of their own
+    std::vector<std::pair<std::string, Section> > extra;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        extra = sections;
+    }
+    typedef std::pair<std::string, Section> Titled_section;
+    BOOST_FOREACH(const Titled_section& section, extra)
+    {
+        s += "\n" + section.first + "\n" + section.second();
+    }
+    return s;
+}
+
+std::string
+Dispatch_stats::counters_report() const
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+
+    std::string header = string_format("%-48s %10s %8s %6s %9s %9s %9s %9s %9s\n",
+                                       "", "count", "stop", "exc",
+                                       "mean(us)", "p50", "p99", "p99.9",
+                                       "max");
+    std::string s = string_format("queue depth %zu (max %zu)\n",
+                                  queue_depth.load(), max_queue_depth.load());
+
+    s += "\nevents\n" + header;
+    Totals t;
+    std::vector<Counters*> counters;
+    for (std::size_t type = 0; type < Event::MAX_TYPES; type++)
+    {
+        counters.clear();
+        BOOST_FOREACH(Shard* shard, shards)
+        {
+            Counters* c = shard->events[type].load(std::memory_order_acquire);
+            if (c)
+            {
+                counters.push_back(c);
+            }
+        }
+        if (sum(counters, t, Counters::N_BUCKETS))
+        {
+            s += format<Counters>(Event::lookup_name(type), t);
+        }
+    }
+
+    s += "\nhandlers\n" + header;
+    for (std::size_t id = 0; id < handler_names.size(); id++)
+    {
+        counters.clear();
+        BOOST_FOREACH(Shard* shard, shards)
+        {
+            Counters* c = shard->handlers[id].load(std::memory_order_acquire);
+            if (c)
+            {
+                counters.push_back(c);
+            }
+        }
+        if (sum(counters, t, Counters::N_BUCKETS))
+        {
+            s += format<Counters>(handler_names[id], t);
+        }
+    }
+    return s;
+}
+
+/* One client of the control socket, kept alive by its pending operation */
+class Dispatch_stats_socket::Session
+    : public boost::enable_shared_from_this<Session>
+{
+public:
+    Session(ba::io_service& io, const Dispatch_stats& stats_)
+        : socket(io), stats(stats_), request(MAX_REQUEST)
+    {
+    }
+
+    void start()
+    {
+        ba::async_read_until(socket, request, '\n',
+                             boost::bind(&Session::handle_request,
+                                         shared_from_this(), _1));
+    }
+
+    protocol::socket socket;
+
+private:
+    static const std::size_t MAX_REQUEST = 512;
+
+    const Dispatch_stats& stats;
+    ba::streambuf request;
+    std::string reply;
+
+    void handle_request(const bs::error_code& ec)
+    {
+        // A request may also end with the client's end of the stream
+        if (ec && ec != ba::error::eof)
+        {
+            VLOG_WARN(lg, "cannot read statistics request: %s",
+                      ec.message().c_str());
+            return;
+        }
+
+        std::istream in(&request);
+        std::string line;
+        std::getline(in, line);
+        if (!line.empty() && line[line.size() - 1] == '\r')
+        {
+            line.erase(line.size() - 1);
+        }
+
+        reply = line == "stats" ? stats.report() : "nak\n";
+        ba::async_write(socket, ba::buffer(reply),
+                        boost::bind(&Session::handle_reply,
+                                    shared_from_this(), _1));
+    }
+
+    void handle_reply(const bs::error_code& ec)
+    {
+        if (ec)
+        {
+            VLOG_WARN(lg, "cannot send statistics report: %s",
+                      ec.message().c_str());
+        }
+    }
+};
+
+Dispatch_stats_socket::Dispatch_stats_socket(ba::io_service& io,
+                                             const Dispatch_stats& stats_)
+    : acceptor(io), stats(stats_)
+{
+}
+
+Dispatch_stats_socket::~Dispatch_stats_socket()
+{
+    close();
+}
+
+void
+Dispatch_stats_socket::listen(const std::string& path_)
+{
+    close();
+
+    path = path_.empty()
+        ? string_format("/tmp/nox-stats.%ld", (long int) getpid()) : path_;
+    unlink(path.c_str());
+
+    acceptor.open();
+    /* Connecting needs write access to the socket file: create it with
+     * none for anyone else. */
+    const mode_t mask = umask(S_IRWXG | S_IRWXO);
+    bs::error_code ec;
+    acceptor.bind(protocol::endpoint(path), ec);
+    umask(mask);
+    if (ec)
+    {
+        throw bs::system_error(ec);
+    }
+    acceptor.listen();
+
+    accept();
+}
+
+void
+Dispatch_stats_socket::close()
+{
+    if (acceptor.is_open())
+    {
+        bs::error_code ec;
+        acceptor.close(ec);
+        unlink(path.c_str());
+    }
+}
+
+void
+Dispatch_stats_socket::accept()
+{
+    boost::shared_ptr<Session> session(
+        new Session(acceptor.get_io_service(), stats));
+    acceptor.async_accept(session->socket,
+                          boost::bind(&Dispatch_stats_socket::handle_accept,
+                                      this, session, _1));
+}
+
+void
+Dispatch_stats_socket::handle_accept(boost::shared_ptr<Session> session,
+                                     const bs::error_code& ec)
+{
+    if (ec == ba::error::operation_aborted)
+    {
+        return;
+    }
+
+    if (ec)
+    {
+        VLOG_WARN(lg, "cannot accept statistics client: %s",
+                  ec.message().c_str());
+    }
+    else
+    {
+        session->start();
+    }
+    accept();
+}
+
+} // namespace vigil
@@ -17,17 +17,26 @@
  */
 #include "event-dispatcher.hh"
 
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <algorithm>
+#include <limits>
 #include <boost/bind.hpp>
 #include <boost/exception/all.hpp>
 #include <boost/foreach.hpp>
-#include <boost/ptr_container/ptr_list.hpp>
 #include <boost/ref.hpp>
+#include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/timer.hpp>
+#include <boost/unordered_set.hpp>
 
 #include "assert.hh"
 #include "new-connection-event.hh"
+#include "reload-event.hh"
 #include "shutdown-event.hh"
+#include "string.hh"
 #include "vlog.hh"
 
 using namespace std;
@@ -39,22 +48,58 @@ static Vlog_module lg("event-dispatcher");
 
 // TODO: Convert timer to Timer_event
 
-Event_dispatcher::Event_dispatcher(const Component_context* c, size_t n_threads)
-    : Component(c), io(/*n_threads*/), work(io), n_threads(n_threads)
+Event_dispatcher::Event_dispatcher(const Component_context* c, size_t n_threads,
+                                   bool sharded, bool pin_cpus)
+    : Component(c), io(/*n_threads*/), work(io), n_threads(n_threads),
+      next_shard(0), sharded(sharded), pin_cpus(pin_cpus),
+      stats_enabled(false), queues(Event::MAX_TYPES),
+      default_queue("default", NORMAL, std::numeric_limits<std::size_t>::max(),
+                    DROP_NEWEST),
+      scheduling(false), starvation_limit(0), n_paused(0), local_reader(&leave_reader),
+      epoch(1)
 {
+    std::fill(streaks, streaks + N_CLASSES, 0);
+
+    shards.push_back(&io);
+    for (std::size_t i = 1; sharded && i < n_threads; i++)
+    {
+        boost::asio::io_service* shard = new boost::asio::io_service(1);
+        shard_io.push_back(shard);
+        shard_work.push_back(new boost::asio::io_service::work(*shard));
+        shards.push_back(shard);
+    }
+
+    dispatch_table.store(new Dispatch_table);
+}
+
+Event_dispatcher::~Event_dispatcher()
+{
+    delete dispatch_table.load();
+    BOOST_FOREACH(const Retired_list::value_type& r, retired)
+    {
+        delete r.second;
+    }
+    BOOST_FOREACH(Reader* reader, readers)
+    {
+        delete reader;
+    }
 }
 
 Component*
-Event_dispatcher::instantiate(const Component_context* ctxt, size_t n_threads)
+Event_dispatcher::instantiate(const Component_context* ctxt, size_t n_threads,
+                              bool sharded, bool pin_cpus)
 {
-    return new Event_dispatcher(ctxt, n_threads);
+    return new Event_dispatcher(ctxt, n_threads, sharded, pin_cpus);
 }
 
 void
 Event_dispatcher::configure()
 {
+    configure_queues();
+
     register_event(New_connection_event::static_get_name());
     register_event(Shutdown_event::static_get_name());
+    register_event(Reload_event::static_get_name());
 
     // read the order of execution of event handlers
     // for every event defined in the configuration
@@ -76,31 +121,369 @@ Event_dispatcher::configure()
         priority_map[event_name] = component_priority;
     }
 
+    stats_enabled = ctxt->get_config<bool>("stats", false);
+    stats_path = ctxt->get_config<std::string>("stats-socket", "");
+
     register_handler(Shutdown_event::static_get_name(),
                      boost::bind(&Event_dispatcher::handle_shutdown, this, _1), 9999);
 }
 
+static Event_dispatcher::Priority_class
+parse_priority_class(const Event_name& name, const std::string& value)
+{
+    if (value == "high")
+    {
+        return Event_dispatcher::HIGH;
+    }
+    else if (value == "normal")
+    {
+        return Event_dispatcher::NORMAL;
+    }
+    else if (value == "low")
+    {
+        return Event_dispatcher::LOW;
+    }
+    throw runtime_error("Unknown priority '" + value + "' for event '" +
+                        name + "'.");
+}
+
+static Event_dispatcher::Overflow_policy
+parse_overflow_policy(const Event_name& name, const std::string& value)
+{
+    if (value == "drop-oldest")
+    {
+        return Event_dispatcher::DROP_OLDEST;
+    }
+    else if (value == "drop-newest")
+    {
+        return Event_dispatcher::DROP_NEWEST;
+    }
+    else if (value == "pause")
+    {
+        return Event_dispatcher::PAUSE;
+    }
+    throw runtime_error("Unknown queue policy '" + value + "' for event '" +
+                        name + "'.");
+}
+
+void
+Event_dispatcher::configure_queues()
+{
+    namespace pt = boost::property_tree;
+
+    boost::unordered_map<Event_name, Priority_class> priorities;
+    if (ctxt->has("priorities"))
+    {
+        BOOST_FOREACH(const pt::ptree::value_type& item,
+                      ctxt->get_config_child("priorities"))
+        {
+            priorities[item.first] =
+                parse_priority_class(item.first, item.second.data());
+        }
+    }
+    else
+    {
+        priorities["ofp_echo_request"] = HIGH;
+        priorities["Openflow_datapath_leave_event"] = HIGH;
+    }
+    starvation_limit = ctxt->get_config<unsigned>("starvation-limit", 16);
+
+    if (ctxt->has("queues"))
+    {
+        BOOST_FOREACH(const pt::ptree::value_type& item,
+                      ctxt->get_config_child("queues"))
+        {
+            const Event_name& name = item.first;
+            const Priority_class priority =
+                priorities.count(name) ? priorities[name] : NORMAL;
+            if (priority == HIGH)
+            {
+                VLOG_WARN(lg, "%s is of high priority, "
+                          "leaving its queue unbounded", name.c_str());
+                continue;
+            }
+
+            const std::size_t limit = item.second.get<std::size_t>("limit");
+            const std::string policy =
+                item.second.get<std::string>("policy", "drop-newest");
+            if (limit == 0)
+            {
+                throw runtime_error("Queue limit of event '" + name +
+                                    "' must be positive.");
+            }
+
+            Event_queue* queue =
+                new Event_queue(name, priority, limit,
+                                parse_overflow_policy(name, policy));
+            event_queues.push_back(queue);
+            queues[Event::lookup_type(name)] = queue;
+            priorities.erase(name);
+            VLOG_DBG(lg, "bounding %s queue to %zu events, %s",
+                     name.c_str(), limit, policy.c_str());
+        }
+    }
+
+    // The rest only need a queue of their own for their class
+    typedef std::pair<const Event_name, Priority_class> Priority;
+    BOOST_FOREACH(const Priority& p, priorities)
+    {
+        if (p.second == NORMAL)
+        {
+            continue;
+        }
+        Event_queue* queue =
+            new Event_queue(p.first, p.second,
+                            std::numeric_limits<std::size_t>::max(),
+                            DROP_NEWEST);
+        event_queues.push_back(queue);
+        queues[Event::lookup_type(p.first)] = queue;
+    }
+}
+
 void
 Event_dispatcher::install()
 {
+    const unsigned n_cpus = std::max(boost::thread::hardware_concurrency(), 1U);
     for (std::size_t i = 1; i <= n_threads; i++)
     {
+        boost::asio::io_service* shard = sharded ? shards[i - 1] : &io;
+        int cpu = pin_cpus ? int((i - 1) % n_cpus) : -1;
         VLOG_DBG(lg, "creating thread %zu", i);
-        tg.create_thread(boost::bind(&boost::asio::io_service::run, &io));
+        tg.create_thread(boost::bind(&Event_dispatcher::run, this, shard, cpu));
+    }
+
+    if (stats_enabled)
+    {
+        stats_socket.reset(new Dispatch_stats_socket(io, stats));
+        try
+        {
+            stats_socket->listen(stats_path);
+        }
+        catch (const boost::system::system_error& e)
+        {
+            VLOG_WARN(lg, "cannot open dispatch statistics socket: %s",
+                      e.what());
+        }
     }
 }
 
+void
+Event_dispatcher::run(boost::asio::io_service* shard, int cpu)
+{
+    if (cpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+        if (error)
+        {
+            VLOG_WARN(lg, "cannot pin thread to CPU %d: %s",
+                      cpu, strerror(error));
+        }
+    }
+    shard->run();
+}
+
 void
 Event_dispatcher::join_all()
 {
     tg.join_all();
 }
 
+/* Deleter of queued events owned by the poster */
+static void
+keep_event(Event*)
+{
+}
+
 void
 Event_dispatcher::post(const Event& event)
 {
-    io.post(boost::bind(&Event_dispatcher::dispatch, this,
-                        boost::cref(event)));
+    post(Event_ptr(const_cast<Event*>(&event), Event_deleter(&keep_event)));
+}
+
+void
+Event_dispatcher::post(Event_ptr event)
+{
+    Event_queue* queue = queues[event->get_type()];
+    if (queue || scheduling.load(std::memory_order_relaxed))
+    {
+        enqueue(queue ? *queue : default_queue, std::move(event));
+        return;
+    }
+
+    // Nothing to order it against yet
+    if (stats_enabled)
+    {
+        stats.posted();
+    }
+    const Event_deleter deleter = event.get_deleter();
+    io.post(boost::bind(&Event_dispatcher::dispatch_posted, this,
+                        event.release(), deleter));
+}
+
+void
+Event_dispatcher::dispatch_posted(Event* event_, Event_deleter deleter)
+{
+    Event_ptr event(event_, deleter);
+    if (stats_enabled)
+    {
+        stats.dequeued();
+    }
+    dispatch_event(*event);
+}
+
+void
+Event_dispatcher::enqueue(Event_queue& queue, Event_ptr event)
+{
+    // Destroyed once the queue is unlocked
+    Event_ptr dropped;
+    {
+        boost::lock_guard<boost::mutex> lock(queue_mutex);
+        if (&queue != &default_queue)
+        {
+            scheduling.store(true, std::memory_order_relaxed);
+        }
+        if (queue.events.size() >= queue.limit)
+        {
+            if (!queue.full)
+            {
+                queue.full = true;
+                VLOG_WARN(lg, "%s queue full, %s", queue.name.c_str(),
+                          queue.policy == PAUSE ? "pausing reads"
+                                                : "dropping events");
+                if (queue.policy == PAUSE)
+                {
+                    ++n_paused;
+                }
+            }
+
+            switch (queue.policy)
+            {
+            case DROP_NEWEST:
+                queue.dropped++;
+                return;
+
+            case DROP_OLDEST:
+                // The run queue entry of the oldest event now serves this one
+                queue.dropped++;
+                dropped = std::move(queue.events.front());
+                queue.events.pop_front();
+                queue.events.push_back(std::move(event));
+                return;
+
+            case PAUSE:
+                break;
+            }
+        }
+        queue.events.push_back(std::move(event));
+        run_queues[queue.priority].push_back(&queue);
+    }
+
+    if (stats_enabled)
+    {
+        stats.posted();
+    }
+    io.post(boost::bind(&Event_dispatcher::dispatch_next, this));
+}
+
+/* Pick the queue of the next event to dispatch.  Must be called with
+ * 'queue_mutex' held, and at least one event pending. */
+Event_dispatcher::Event_queue&
+Event_dispatcher::next_queue()
+{
+    unsigned c = 0;
+    while (run_queues[c].empty())
+    {
+        c++;
+    }
+    assert(c < N_CLASSES);
+
+    unsigned lower = c + 1;
+    while (lower < N_CLASSES && run_queues[lower].empty())
+    {
+        lower++;
+    }
+
+    if (lower == N_CLASSES)
+    {
+        streaks[c] = 0;
+    }
+    else if (++streaks[c] > starvation_limit)
+    {
+        // Let the waiting class have one
+        streaks[c] = 0;
+        c = lower;
+    }
+
+    Event_queue* queue = run_queues[c].front();
+    run_queues[c].pop_front();
+    return *queue;
+}
+
+void
+Event_dispatcher::dispatch_next()
+{
+    Event_ptr event;
+    std::vector<boost::function<void()> > readers;
+    {
+        boost::lock_guard<boost::mutex> lock(queue_mutex);
+        Event_queue& queue = next_queue();
+        event = std::move(queue.events.front());
+        queue.events.pop_front();
+        if (queue.full && queue.events.size() <= queue.limit / 2)
+        {
+            queue.full = false;
+            if (queue.policy == PAUSE && --n_paused == 0)
+            {
+                readers.swap(paused_readers);
+            }
+            VLOG_WARN(lg, "%s queue drained, %" PRIu64 " events dropped so far",
+                      queue.name.c_str(), queue.dropped);
+        }
+    }
+
+    if (stats_enabled)
+    {
+        stats.dequeued();
+    }
+    BOOST_FOREACH(const boost::function<void()>& resume, readers)
+    {
+        resume();
+    }
+    dispatch_event(*event);
+}
+
+/* Log the first event of 'type' dispatched without being posted, if the
+ * type has a bounded queue that it thereby escapes. */
+void
+Event_dispatcher::check_unposted(Event_type type) const
+{
+    Event_queue* queue = queues[type];
+    if (queue && queue->is_bounded()
+        && !queue->unposted.load(std::memory_order_relaxed)
+        && !queue->unposted.exchange(true))
+    {
+        VLOG_WARN(lg, "%s events are dispatched without being posted, "
+                  "their queue limit of %zu does not apply",
+                  queue->name.c_str(), queue->limit);
+    }
+}
+
+void
+Event_dispatcher::when_ready(const boost::function<void()>& resume)
+{
+    if (n_paused.load() > 0)
+    {
+        boost::lock_guard<boost::mutex> lock(queue_mutex);
+        if (n_paused.load() > 0)
+        {
+            paused_readers.push_back(resume);
+            return;
+        }
+    }
+    resume();
 }
 
 std::unique_ptr<boost::asio::deadline_timer>
@@ -121,15 +504,45 @@ bool
 Event_dispatcher::register_event(const Event_name& name)
 {
     VLOG_DBG(lg, "Registering event '%s'.", name.c_str());
-    if (priority_map.find(name) == priority_map.end())
+    const Event_type type = Event::lookup_type(name);
+
     {
-        Component_priority cp;
-        priority_map[name] = cp;
-        Call_chain cc;
-        call_chain_map[name] = cc;
-        return true;
+        boost::lock_guard<boost::mutex> lock(priority_map_queue_mutex);
+        if (priority_map.find(name) != priority_map.end())
+        {
+            return false;
+        }
+        priority_map[name] = Component_priority();
     }
-    return false;
+
+    // Reserve the slot up front, so dispatch() needs only a bounds check
+    boost::lock_guard<boost::mutex> lock(call_chain_mutex);
+    const Dispatch_table& current = *dispatch_table.load();
+    if (type >= current.size())
+    {
+        Dispatch_table* table = new Dispatch_table(current);
+        table->resize(type + 1);
+        publish(table);
+    }
+    return true;
+}
+
+bool
+Event_dispatcher::get_priority(const Component_name& component_name,
+                               const Event_name& event_name,
+                               int& order) const
+{
+    boost::lock_guard<boost::mutex> lock(priority_map_queue_mutex);
+    Priority_map::const_iterator pm = priority_map.find(event_name);
+    if (pm == priority_map.end())
+    {
+        return false;
+    }
+
+    const Component_priority& cp = pm->second;
+    Component_priority::const_iterator it = cp.find(component_name);
+    order = it != cp.end() ? it->second : 0;
+    return true;
 }
 
 bool
@@ -137,71 +550,428 @@ Event_dispatcher::register_handler(const Component_name& component_name,
                                    const Event_name& event_name,
                                    const Event_handler& h)
 {
-    if (priority_map.find(event_name) == priority_map.end())
+    int order;
+    if (!get_priority(component_name, event_name, order))
     {
         return false;
     }
 
-    Component_priority& cp = priority_map[event_name];
-    if (cp.find(component_name) == cp.end())
+    VLOG_DBG(lg, "Registering handler for %s, order %d",
+             event_name.c_str(), order);
+
+    insert_handler(Event::lookup_type(event_name),
+                   Event_handler_wrapper(h, order, component_name),
+                   component_name, &Dispatch_entry::call_chain);
+    return true;
+}
+
+void
+Event_dispatcher::register_handler(const Event_name& event_name,
+                                   const Event_handler& handler, int order)
+{
+    VLOG_DBG(lg, "Registering handler for %s, order %d",
+             event_name.c_str(), order);
+
+    insert_handler(Event::lookup_type(event_name),
+                   Event_handler_wrapper(handler, order),
+                   string_format("order %d", order),
+                   &Dispatch_entry::call_chain);
+}
+
+bool
+Event_dispatcher::register_handler(const Component_name& component_name,
+                                   const Event_name& event_name,
+                                   const Typed_event_handler& h)
+{
+    int order;
+    if (!get_priority(component_name, event_name, order))
     {
-        register_handler(event_name, h, 0);
+        return false;
     }
-    else
+
+    VLOG_DBG(lg, "Registering typed handler for %s, order %d",
+             event_name.c_str(), order);
+
+    insert_handler(h.get_type(),
+                   Event_handler_wrapper(h, order, component_name),
+                   component_name, &Dispatch_entry::call_chain);
+    return true;
+}
+
+bool
+Event_dispatcher::register_batch_handler(const Component_name& component_name,
+                                         const Event_name& event_name,
+                                         const Event_handler& h)
+{
+    int order;
+    if (!get_priority(component_name, event_name, order))
     {
-        register_handler(event_name, h, cp[component_name]);
+        return false;
     }
 
+    VLOG_DBG(lg, "Registering batch handler for %s, order %d",
+             event_name.c_str(), order);
+
+    insert_handler(Event::lookup_type(event_name),
+                   Event_handler_wrapper(h, order, component_name),
+                   component_name + " (batch)",
+                   &Dispatch_entry::batch_call_chain);
     return true;
 }
 
 void
-Event_dispatcher::register_handler(const Event_name& event_name,
-                                   const Event_handler& handler, int order)
+Event_dispatcher::register_batch_handler(const Event_name& event_name,
+                                         const Event_handler& handler,
+                                         int order)
 {
-    VLOG_DBG(lg, "Registering handler for %s, order %d",
+    VLOG_DBG(lg, "Registering batch handler for %s, order %d",
              event_name.c_str(), order);
 
-    //boost::unique_lock<boost::mutex> lock(table_mutex);
-    Event_handler_wrapper ehw(handler, order);
-    call_chain_map[event_name].insert(ehw);
+    insert_handler(Event::lookup_type(event_name),
+                   Event_handler_wrapper(handler, order),
+                   string_format("order %d (batch)", order),
+                   &Dispatch_entry::batch_call_chain);
+}
+
+bool
+Event_dispatcher::unregister_handler(const Component_name& component_name,
+                                     const Event_name& event_name)
+{
+    VLOG_DBG(lg, "Unregistering handlers of %s for %s",
+             component_name.c_str(), event_name.c_str());
+
+    const Event_type type = Event::lookup_type(event_name);
+    boost::lock_guard<boost::mutex> lock(call_chain_mutex);
+    const Dispatch_table& current = *dispatch_table.load();
+    if (type >= current.size())
+    {
+        return false;
+    }
+
+    Dispatch_table* table = new Dispatch_table(current);
+    if (!remove_handlers((*table)[type], component_name))
+    {
+        delete table;
+        return false;
+    }
+    publish(table);
+    return true;
+}
+
+bool
+Event_dispatcher::has_handlers(const Event_name& event_name)
+{
+    const Event_type type = Event::lookup_type(event_name);
+    boost::lock_guard<boost::mutex> lock(call_chain_mutex);
+    const Dispatch_table& current = *dispatch_table.load();
+    return type < current.size()
+        && (!current[type].call_chain.empty()
+            || !current[type].batch_call_chain.empty());
 }
 
 void
-Event_dispatcher::dispatch(const Event& event) const
+Event_dispatcher::unregister_handlers(const Component_name& component_name)
 {
-    //boost::unique_lock<boost::mutex> lock(table_mutex);
-    const Event_name& event_name = event.get_name();
-    Call_chain_map::const_iterator it = call_chain_map.find(event_name);
-    if (it != call_chain_map.end())
+    VLOG_DBG(lg, "Unregistering handlers of %s", component_name.c_str());
+
+    boost::lock_guard<boost::mutex> lock(call_chain_mutex);
+    Dispatch_table* table = new Dispatch_table(*dispatch_table.load());
+    bool removed = false;
+    BOOST_FOREACH(Dispatch_entry& entry, *table)
     {
-        const Call_chain& call_chain = it->second;
-        BOOST_FOREACH(const Event_handler_wrapper& ehw, call_chain)
+        removed |= remove_handlers(entry, component_name);
+    }
+
+    if (!removed)
+    {
+        delete table;
+        return;
+    }
+    publish(table);
+}
+
+bool
+Event_dispatcher::remove_handlers(Dispatch_entry& entry,
+                                  const Component_name& component_name)
+{
+    const std::size_t n = entry.call_chain.size() +
+        entry.batch_call_chain.size();
+    entry.call_chain.erase(
+        std::remove_if(entry.call_chain.begin(), entry.call_chain.end(),
+                       boost::bind(&Event_handler_wrapper::get_owner, _1)
+                       == component_name),
+        entry.call_chain.end());
+    entry.batch_call_chain.erase(
+        std::remove_if(entry.batch_call_chain.begin(),
+                       entry.batch_call_chain.end(),
+                       boost::bind(&Event_handler_wrapper::get_owner, _1)
+                       == component_name),
+        entry.batch_call_chain.end());
+    return entry.call_chain.size() + entry.batch_call_chain.size() < n;
+}
+
+void
+Event_dispatcher::insert_handler(Event_type type,
+                                 Event_handler_wrapper ehw,
+                                 const std::string& owner,
+                                 Call_chain Dispatch_entry::* chain)
+{
+    ehw.set_id(stats.add_handler(Event::lookup_name(type), owner));
+
+    boost::lock_guard<boost::mutex> lock(call_chain_mutex);
+    Dispatch_table* table = new Dispatch_table(*dispatch_table.load());
+    if (type >= table->size())
+    {
+        table->resize(type + 1);
+    }
+    // Insert after any handler of equal priority, as a multiset would
+    Call_chain& call_chain = (*table)[type].*chain;
+    call_chain.insert(std::upper_bound(call_chain.begin(), call_chain.end(),
+                                       ehw), ehw);
+    publish(table);
+}
+
+/* Tracks a thread through dispatch() and dispatch_batch(), so that the
+ * tables it may be reading are not reclaimed under it. */
+class Event_dispatcher::Read_guard
+{
+public:
+    explicit Read_guard(const Event_dispatcher& ed)
+        : reader(ed.get_reader())
+    {
+        // Handlers may dispatch in turn: only the outermost call counts
+        if (reader.depth++ == 0)
         {
-            try
+            reader.epoch.store(ed.epoch.load());
+        }
+    }
+
+    ~Read_guard()
+    {
+        if (--reader.depth == 0)
+        {
+            reader.epoch.store(0, std::memory_order_release);
+        }
+    }
+
+private:
+    Reader& reader;
+};
+
+/* Readers are owned by the dispatcher, not by their threads. */
+void
+Event_dispatcher::leave_reader(Reader*)
+{
+}
+
+Event_dispatcher::Reader&
+Event_dispatcher::get_reader() const
+{
+    Reader* reader = local_reader.get();
+    if (!reader)
+    {
+        reader = new Reader;
+        local_reader.reset(reader);
+        boost::lock_guard<boost::mutex> lock(readers_mutex);
+        readers.push_back(reader);
+    }
+    return *reader;
+}
+
+/* Swap in 'table' and retire the current one.  Must be called with
+ * 'call_chain_mutex' held. */
+void
+Event_dispatcher::publish(Dispatch_table* table)
+{
+    const Dispatch_table* old = dispatch_table.exchange(table);
+    retired.push_back(std::make_pair(++epoch, old));
+    reclaim();
+}
+
+/* Delete the retired tables no reader can be walking anymore: a table
+ * retired at epoch 'e' is unreachable to readers that entered at epoch 'e'
+ * or later.  Must be called with 'call_chain_mutex' held. */
+void
+Event_dispatcher::reclaim()
+{
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+    {
+        boost::lock_guard<boost::mutex> lock(readers_mutex);
+        BOOST_FOREACH(const Reader* reader, readers)
+        {
+            const uint64_t e = reader->epoch.load();
+            if (e)
             {
-                if (ehw(event) == STOP)
+                oldest = std::min(oldest, e);
+            }
+        }
+    }
+
+    Retired_list::iterator it = retired.begin();
+    while (it != retired.end())
+    {
+        if (it->first <= oldest)
+        {
+            delete it->second;
+            it = retired.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void
+Event_dispatcher::synchronize()
+{
+    const uint64_t now = epoch.load();
+    const Reader* self = local_reader.get();
+    for (;;)
+    {
+        bool waiting = false;
+        {
+            boost::lock_guard<boost::mutex> lock(readers_mutex);
+            BOOST_FOREACH(const Reader* reader, readers)
+            {
+                const uint64_t e = reader->epoch.load();
+                if (reader != self && e && e < now)
                 {
+                    waiting = true;
                     break;
                 }
             }
-            catch (const exception& e)
+        }
+        if (!waiting)
+        {
+            break;
+        }
+        boost::this_thread::yield();
+    }
+
+    boost::lock_guard<boost::mutex> lock(call_chain_mutex);
+    reclaim();
+}
+
+void
+Event_dispatcher::dispatch(const Event& event) const
+{
+    check_unposted(event.get_type());
+    dispatch_event(event);
+}
+
+void
+Event_dispatcher::dispatch_event(const Event& event) const
+{
+    Read_guard guard(*this);
+    const Dispatch_table& table = *dispatch_table.load();
+    const Event_type type = event.get_type();
+    if (type >= table.size())
+    {
+        return;
+    }
+
+    const Dispatch_entry& entry = table[type];
+    const uint64_t start = stats_enabled ? Dispatch_stats::now() : 0;
+    Disposition d = CONTINUE;
+    if (!entry.batch_call_chain.empty())
+    {
+        const Event* events[] = { &event };
+        d = call(entry.batch_call_chain, Batch_event(type, events, events + 1));
+    }
+    if (d != STOP)
+    {
+        d = call(entry.call_chain, event);
+    }
+    if (stats_enabled)
+    {
+        stats.record_event(type, Dispatch_stats::now() - start, d);
+    }
+}
+
+void
+Event_dispatcher::dispatch_batch(const Batch_event& batch) const
+{
+    check_unposted(batch.get_type());
+    Read_guard guard(*this);
+    const Dispatch_table& table = *dispatch_table.load();
+    const Event_type type = batch.get_type();
+    if (type >= table.size())
+    {
+        return;
+    }
+
+    const Dispatch_entry& entry = table[type];
+    const uint64_t start = stats_enabled ? Dispatch_stats::now() : 0;
+    Disposition d = CONTINUE;
+    if (!entry.batch_call_chain.empty())
+    {
+        d = call(entry.batch_call_chain, batch);
+    }
+    if (d != STOP && !entry.call_chain.empty())
+    {
+        BOOST_FOREACH(const Event* event, batch)
+        {
+            call(entry.call_chain, *event);
+        }
+    }
+    if (stats_enabled)
+    {
+        stats.record_event(type, Dispatch_stats::now() - start, d,
+                           batch.size());
+    }
+}
+
+/* Run 'call_chain' on 'event'.  Returns STOP if a handler stopped the chain
+ * or leaked an exception. */
+Disposition
+Event_dispatcher::call(const Call_chain& call_chain, const Event& event) const
+{
+    BOOST_FOREACH(const Event_handler_wrapper& ehw, call_chain)
+    {
+        const uint64_t start = stats_enabled ? Dispatch_stats::now() : 0;
+        try
+        {
+            Disposition d = ehw(event);
+            if (stats_enabled)
+            {
+                stats.record_handler(event.get_type(), ehw.get_id(),
+                                     Dispatch_stats::now() - start, d, false);
+            }
+            if (d == STOP)
             {
-                VLOG_ERR(lg, "Event %s processing leaked an exception: %s",
-                         event_name.c_str(), e.what());
-                VLOG_ERR(lg, "Extra information:\n%s",
-                         boost::current_exception_diagnostic_information().c_str());
-                break;
+                return STOP;
+            }
+        }
+        catch (const exception& e)
+        {
+            if (stats_enabled)
+            {
+                stats.record_handler(event.get_type(), ehw.get_id(),
+                                     Dispatch_stats::now() - start, STOP, true);
             }
+            VLOG_ERR(lg, "Event %s processing leaked an exception: %s",
+                     event.get_name().c_str(), e.what());
+            VLOG_ERR(lg, "Extra information:\n%s",
+                     boost::current_exception_diagnostic_information().c_str());
+            return STOP;
         }
     }
+    return CONTINUE;
 }
 
 Disposition
 Event_dispatcher::handle_shutdown(const Event& e)
 {
     VLOG_ERR(lg, "Shutting down");
-    io.stop();
+    if (stats_socket.get())
+    {
+        stats_socket->close();
+    }
+    BOOST_FOREACH(boost::asio::io_service* shard, shards)
+    {
+        shard->stop();
+    }
     return CONTINUE;
 }
 
@@ -0,0 +1,79 @@
+/* Copyright 2008 (C) Nicira, Inc.
+ *
+ * This file is part of NOX.
+ *
+ * NOX is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NOX is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NOX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "event.hh"
+
+#include <atomic>
+#include <stdexcept>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "assert.hh"
+
+using namespace std;
+
+namespace vigil
+{
+
+namespace
+{
+
+typedef boost::unordered_map<Event_name, Event_type> Type_map;
+
+boost::mutex type_map_mutex;
+Type_map type_map;
+
+/* Names are published once, under 'type_map_mutex', before the id is handed
+ * out, and never move afterwards (unordered_map nodes are stable).  The
+ * release store pairs with the acquire load in lookup_name(), which runs
+ * on every dispatch and so takes no lock. */
+std::atomic<const Event_name*> type_names[Event::MAX_TYPES];
+
+} // unnamed namespace
+
+Event_type
+Event::lookup_type(const Event_name& name)
+{
+    boost::lock_guard<boost::mutex> lock(type_map_mutex);
+    Type_map::const_iterator it = type_map.find(name);
+    if (it != type_map.end())
+    {
+        return it->second;
+    }
+
+    if (type_map.size() >= MAX_TYPES)
+    {
+        throw runtime_error("Too many event types, can't bind '" + name + "'.");
+    }
+
+    Event_type type = type_map.size();
+    it = type_map.insert(make_pair(name, type)).first;
+    type_names[type].store(&it->first, std::memory_order_release);
+    return type;
+}
+
+const Event_name&
+Event::lookup_name(Event_type type)
+{
+    assert(type < MAX_TYPES);
+    const Event_name* name = type_names[type].load(std::memory_order_acquire);
+    assert(name);
+    return *name;
+}
+
+} // namespace vigil
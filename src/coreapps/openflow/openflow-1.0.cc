@@ -40,14 +40,17 @@ namespace openflow
 namespace v1
 {
 
-ofp_msg::factory_map_t ofp_msg::factory_map;
-ofp_stats_request::factory_map_t ofp_stats_request::factory_map;
-ofp_stats_reply::factory_map_t ofp_stats_reply::factory_map;
+ofp_factory<ofp_msg> ofp_msg::factory_table[UINT8_MAX + 1];
+ofp_factory<ofp_stats_request>
+ofp_stats_request::factory_table[ofp_stats_request::N_FACTORIES + 1];
+ofp_factory<ofp_stats_reply>
+ofp_stats_reply::factory_table[ofp_stats_reply::N_FACTORIES + 1];
 ofp_vendor_stats_request::factory_map_t ofp_vendor_stats_request::factory_map;
 ofp_vendor_stats_reply::factory_map_t ofp_vendor_stats_reply::factory_map;
-ofp_action::factory_map_t ofp_action::factory_map;
+ofp_factory<ofp_action> ofp_action::factory_table[ofp_action::N_FACTORIES + 1];
 ofp_action_vendor::factory_map_t ofp_action_vendor::factory_map;
-ofp_queue_prop::factory_map_t ofp_queue_prop::factory_map;
+ofp_factory<ofp_queue_prop>
+ofp_queue_prop::factory_table[ofp_queue_prop::N_FACTORIES + 1];
 ofp_vendor::factory_map_t ofp_vendor::factory_map;
 
 } // namespace v1
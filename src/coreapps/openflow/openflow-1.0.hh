@@ -36,7 +36,6 @@
 
 /* OpenFlow: protocol between controller and datapath. */
 
-#include <array>
 #include <stdint.h>
 
 #include <boost/archive/polymorphic_iarchive.hpp>
@@ -44,11 +43,13 @@
 #include <boost/asio/buffer.hpp>
 #include <boost/function.hpp>
 #include <boost/preprocessor.hpp>
+#include <boost/shared_array.hpp>
 #include <boost/unordered_map.hpp>
 #include <boost/variant.hpp>
 
 #include <openflow/openflow-defs-1.0.hh>
 
+#include "event.hh"
 #include "network_iarchive.hh"
 #include "network_oarchive.hh"
 #include "netinet++/ethernet.hh"
@@ -70,7 +71,14 @@ namespace v1
 #define OFBOILERPLATE() \
     public: \
     template<class Archive> void serialize(Archive&, unsigned int); \
-    virtual const char* name() const { return BOOST_PP_STRINGIZE(OFCLASS); }
+    static const char* static_get_name() { return BOOST_PP_STRINGIZE(OFCLASS); } \
+    virtual const char* name() const { return static_get_name(); } \
+    virtual Event_type event_type() const \
+    { \
+        static const Event_type type = \
+            Event::lookup_type(BOOST_PP_STRINGIZE(OFCLASS)); \
+        return type; \
+    }
 
 inline uint32_t next_xid()
 {
@@ -86,6 +94,112 @@ boost::archive::polymorphic_iarchive&,
 boost::archive::polymorphic_oarchive&
 > ofp_archive_type;
 
+/* How to construct and serialize one type of a family of OpenFlow
+ * objects (messages, actions, ...).  The network archives, which carry
+ * all traffic to and from datapaths, call straight through 'load' and
+ * 'save'; any other archive goes through 'generic'. */
+template<class Base>
+struct ofp_factory
+{
+    typedef void (*load_t)(network_iarchive&, Base*, Base&);
+    typedef void (*save_t)(network_oarchive&, Base&);
+    typedef boost::function<void(ofp_archive_type, Base*, Base&)> generic_t;
+
+    ofp_factory() : load(0), save(0) {}
+    template<class Generic>
+    ofp_factory(const Generic& generic_)
+        : load(0), save(0), generic(generic_) {}
+
+    void operator()(ofp_archive_type ar, Base* mem, Base& b) const
+    {
+        generic(ar, mem, b);
+    }
+    void operator()(network_iarchive& ar, Base* mem, Base& b) const
+    {
+        if (load)
+            load(ar, mem, b);
+        else
+            generic(ar, mem, b);
+    }
+    void operator()(network_oarchive& ar, Base* mem, Base& b) const
+    {
+        if (save)
+            save(ar, b);
+        else
+            generic(ar, mem, b);
+    }
+
+    load_t load;
+    save_t save;
+    generic_t generic;
+};
+
+/* Slot of a 16-bit type in a factory table of N + 1 entries: types below
+ * N - 1 have their own, the vendor type 0xffff takes slot N - 1, and all
+ * others share slot N, which is left empty. */
+template<std::size_t N>
+constexpr std::size_t ofp_factory_slot(uint16_t type)
+{
+    return type < N - 1 ? type : type == 0xffff ? N - 1 : N;
+}
+
+/* List of variable-length elements: actions or queue properties.
+ *
+ * A loaded list is sized to the message, in storage from the archive's
+ * arena or, failing that, held by 'storage_' (see load_storage()).  Lists
+ * built with push_back() keep their pointers on the heap, copied before
+ * being appended to if shared with a copy of the list. */
+template<class T>
+class ofp_list
+{
+public:
+    ofp_list() : length_(0), elems_(0), capacity_(0), list_(0) {}
+
+    const std::size_t& length() {
+        return length_;
+    }
+    void length(const std::size_t& length) {
+        length_ = length;
+    }
+
+    std::size_t size() const {
+        return elems_;
+    }
+    T* operator[](std::size_t i) const {
+        return list_[i];
+    }
+
+protected:
+    void append(T* elem)
+    {
+        if (elems_ == capacity_ || !owned_ || !owned_.unique())
+        {
+            const std::size_t capacity =
+                elems_ == capacity_ ? 2 * capacity_ + 4 : capacity_;
+            boost::shared_array<T*> owned(new T*[capacity]);
+            std::copy(list_, list_ + elems_, owned.get());
+            owned_ = owned;
+            list_ = owned_.get();
+            capacity_ = capacity;
+        }
+        list_[elems_++] = elem;
+        length_ += elem->len();
+    }
+
+    /* Load 'length_' bytes of elements, each constructed in a slot of
+     * 'object_bytes', or save the elements. */
+    template<class Archive>
+    void serialize_list(Archive&, std::size_t object_bytes);
+
+private:
+    std::size_t length_;
+    std::size_t elems_;
+    std::size_t capacity_;
+    T** list_;
+    boost::shared_array<T*> owned_;
+    boost::shared_array<uint8_t> storage_;
+};
+
 //
 // 1. OpenFlow Header
 
@@ -169,16 +283,16 @@ public:
         return OFPT_INVALID;
     }
 
-    void factory(ofp_archive_type, ofp_msg*);
-    static void register_factory(uint8_t, factory_t);
+    template<class Archive> void factory(Archive&, ofp_msg*);
+    static void register_factory(uint8_t, const ofp_factory<ofp_msg>&);
 
     OFDEFMEM(uint8_t, version);    // openflow version
     OFDEFMEM(uint8_t, type);       // message type
     OFDEFMEM(uint16_t, length);    // message length including header
     OFDEFMEM(uint32_t, xid);       // transaction id
 private:
-    typedef boost::unordered_map<uint8_t, factory_t> factory_map_t;
-    static factory_map_t factory_map;
+    /* Indexed by message type */
+    static ofp_factory<ofp_msg> factory_table[UINT8_MAX + 1];
 };
 
 //
@@ -330,12 +444,13 @@ public:
         return 8;
     }
 
-    void factory(ofp_archive_type, ofp_queue_prop*);
-    static void register_factory(uint16_t, factory_t);
+    template<class Archive> void factory(Archive&, ofp_queue_prop*);
+    static void register_factory(uint16_t, const ofp_factory<ofp_queue_prop>&);
 
 private:
-    typedef boost::unordered_map<uint16_t, factory_t> factory_map_t;
-    static factory_map_t factory_map;
+    /* Indexed by ofp_factory_slot<N_FACTORIES>() */
+    static const std::size_t N_FACTORIES = 16;
+    static ofp_factory<ofp_queue_prop> factory_table[N_FACTORIES + 1];
 
     OFDEFMEM(uint16_t, property);   /* One of OFPQT_. */
     OFDEFMEM(uint16_t, len);        /* Length of property, including this header. */
@@ -357,31 +472,16 @@ public:
     }
 };
 
-class ofp_queue_prop_list
+class ofp_queue_prop_list : public ofp_list<const ofp_queue_prop>
 {
 #undef OFCLASS
 #define OFCLASS ofp_queue_prop_list
     OFBOILERPLATE();
 public:
-    ofp_queue_prop_list() : length_(0), elems_(0) {}
     ofp_queue_prop_list& push_back(const ofp_queue_prop*& queue_prop) {
-        list_[elems_++] = queue_prop;
-        length_ += queue_prop->len();
+        append(queue_prop);
         return *this;
     }
-
-    const std::size_t& length() {
-        return length_;
-    }
-    void length(const std::size_t& length) {
-        length_ = length;
-    }
-
-private:
-    std::size_t length_;
-    std::size_t elems_;
-    std::array<const ofp_queue_prop*, OFP_MAX_QUEUE_PROP_COUNT> list_;
-    uint8_t storage_[OFP_MAX_QUEUE_PROP_COUNT][OFP_MAX_QUEUE_PROP_BYTES];
 };
 
 /* Min-Rate queue property description. */
@@ -530,12 +630,13 @@ public:
 
     static void init();
 
-    void factory(ofp_archive_type, ofp_action*);
-    static void register_factory(uint16_t, factory_t);
+    template<class Archive> void factory(Archive&, ofp_action*);
+    static void register_factory(uint16_t, const ofp_factory<ofp_action>&);
 
 private:
-    typedef boost::unordered_map<uint16_t, factory_t> factory_map_t;
-    static factory_map_t factory_map;
+    /* Indexed by ofp_factory_slot<N_FACTORIES>() */
+    static const std::size_t N_FACTORIES = 16;
+    static ofp_factory<ofp_action> factory_table[N_FACTORIES + 1];
 
     OFDEFMEM(uint16_t, type);                 /* One of OFPAT_*. */
     OFDEFMEM(uint16_t, len);                  /* Length of action, including this
@@ -544,32 +645,16 @@ private:
                                                  64-bit aligned. */
 };
 
-class ofp_action_list
+class ofp_action_list : public ofp_list<ofp_action>
 {
 #undef OFCLASS
 #define OFCLASS ofp_action_list
     OFBOILERPLATE();
 public:
-    ofp_action_list() : length_(0), elems_(0) { }
-
     ofp_action_list& push_back(ofp_action* action) {
-        list_[elems_++] = action;
-        length_ += action->len();
+        append(action);
         return *this;
     }
-
-    const std::size_t& length() {
-        return length_;
-    }
-    void length(const std::size_t& length) {
-        length_ = length;
-    }
-
-private:
-    std::size_t length_;
-    std::size_t elems_;
-    std::array<ofp_action*, OFP_MAX_ACTION_COUNT> list_;
-    uint8_t storage_[OFP_MAX_ACTION_COUNT][OFP_MAX_ACTION_BYTES];
 };
 
 /* Action classure for OFPAT_OUTPUT, which sends packets out 'port'.
@@ -893,12 +978,12 @@ public:
         return OFPAT_VENDOR;
     }
 
-    void factory(ofp_archive_type, ofp_action_vendor*);
-    static void register_factory(uint32_t, factory_t);
+    template<class Archive> void factory(Archive&, ofp_action_vendor*);
+    static void register_factory(uint32_t, const ofp_factory<ofp_action_vendor>&);
 
     OFDEFMEM(uint32_t, vendor);
 private:
-    typedef boost::unordered_map<uint32_t, factory_t> factory_map_t;
+    typedef boost::unordered_map<uint32_t, ofp_factory<ofp_action_vendor> > factory_map_t;
     static factory_map_t factory_map;
 };
 
@@ -932,11 +1017,12 @@ public:
 
     ofp_features_reply()
         : ofp_msg(OFPT_FEATURES_REPLY, OFP_FEATURES_REPLY_BYTES), datapath_id_(0),
-          n_buffers_(0), n_tables_(0), capabilities_(0), actions_(0)
+          n_buffers_(0), n_tables_(0), capabilities_(0), actions_(0),
+          ports_(0), n_ports_(0)
     {
         std::fill(pad_, pad_ + sizeof(pad_), '\0');
     }
-    ofp_features_reply(ofp_msg& msg) : ofp_msg(msg) {}
+    ofp_features_reply(ofp_msg& msg) : ofp_msg(msg), ports_(0), n_ports_(0) {}
 
     static std::size_t min_bytes() {
         return 32;
@@ -947,6 +1033,30 @@ public:
         return OFPT_FEATURES_REPLY;
     }
 
+    /* The ports of a received reply lie in storage of its datapath: they
+     * are only valid while the message is being dispatched. */
+    const ofp_phy_port* ports() const
+    {
+        return ports_;
+    }
+    std::size_t n_ports() const
+    {
+        return n_ports_;
+    }
+    /* Copy the ports to storage of this object's own, for a copy of a
+     * received reply kept past its dispatch. */
+    void own_ports()
+    {
+        boost::shared_array<uint8_t> storage(
+            new uint8_t[n_ports_ * sizeof(ofp_phy_port)]);
+        ofp_phy_port* ports = reinterpret_cast<ofp_phy_port*>(storage.get());
+        for (std::size_t i = 0; i < n_ports_; i++)
+        {
+            ::new(&ports[i])ofp_phy_port(ports_[i]);
+        }
+        ports_ = ports;
+        storage_ = storage;
+    }
 
     /* Datapath unique ID.  The lower 48-bits are for
        a MAC address, while the upper 16-bits are
@@ -961,11 +1071,12 @@ private:
     OFDEFMEM(uint32_t, actions);      /* Bitmap of supported "ofp_action_type"s. */
 
     /* Port info.*/
-    ofp_phy_port ports_[ofp_phy_port::OFPP_MAX_NOX]; /* Port definitions.  The number of ports
-                                                      * is inferred from the length field in
-                                                      * the header. */
+    ofp_phy_port* ports_;                   /* Port definitions.  The number of ports
+                                             * is inferred from the length field in
+                                             * the header. */
     /* Defined by Amin */
     std::size_t n_ports_;
+    boost::shared_array<uint8_t> storage_;  /* Ports not loaded in an arena. */
 };
 
 //typedef ofp_features_reply ofp_switch_features;
@@ -1159,11 +1270,12 @@ class ofp_queue_get_config_reply : public ofp_msg
     OFBOILERPLATE();
 public:
     ofp_queue_get_config_reply()
-        : ofp_msg(OFPT_QUEUE_GET_CONFIG_REPLY, OFP_QUEUE_GET_CONFIG_REPLY_BYTES), port_(0)
+        : ofp_msg(OFPT_QUEUE_GET_CONFIG_REPLY, OFP_QUEUE_GET_CONFIG_REPLY_BYTES), port_(0),
+          queues_(0), n_queues_(0)
     {
         std::fill(pad_, pad_ + sizeof(pad_), '\0');
     }
-    ofp_queue_get_config_reply(ofp_msg& msg) : ofp_msg(msg) {}
+    ofp_queue_get_config_reply(ofp_msg& msg) : ofp_msg(msg), queues_(0), n_queues_(0) {}
 
     static std::size_t min_bytes() {
         return 16;
@@ -1178,9 +1290,10 @@ public:
 private:
     OFDEFMEM(uint16_t, port);
     uint8_t pad_[6];
-    ofp_packet_queue queues_[OFP_MAX_QUEUES]; /* List of configured queues. */
+    ofp_packet_queue* queues_;              /* List of configured queues. */
     /* Defined by Amin */
     std::size_t n_queues_;
+    boost::shared_array<uint8_t> storage_;  /* Queues not loaded in an arena. */
 };
 
 // 3.5. Read State Messages
@@ -1332,6 +1445,8 @@ private:
     OFDEFMEM(uint64_t, tx_errors);     /* Number of packets dropped due to overrun. */
 };
 
+/* Body of a stats reply, loaded into storage sized to the reply from the
+ * archive's arena or, failing that, the heap. */
 template<class Type>
 class ofp_stats_list
 {
@@ -1339,7 +1454,7 @@ class ofp_stats_list
 #define OFCLASS ofp_stats_list
     OFBOILERPLATE();
 public:
-    ofp_stats_list() : length_(0), elems_(0) {}
+    ofp_stats_list() : length_(0), elems_(0), list_(0) {}
 
     const std::size_t& length() {
         return length_;
@@ -1348,10 +1463,18 @@ public:
         length_ = length;
     }
 
+    std::size_t size() const {
+        return elems_;
+    }
+    const Type& operator[](std::size_t i) const {
+        return list_[i];
+    }
+
 private:
     std::size_t length_;
     std::size_t elems_;
-    std::array<Type, OFP_MAX_STATS_PER_REPLY> list_;
+    Type* list_;
+    boost::shared_array<uint8_t> storage_;
 };
 
 class ofp_stats : public ofp_msg
@@ -1438,12 +1561,13 @@ public:
         return OFPT_STATS_REQUEST;
     }
 
-    void factory(ofp_archive_type, ofp_stats_request*);
-    static void register_factory(uint16_t, factory_t);
+    template<class Archive> void factory(Archive&, ofp_stats_request*);
+    static void register_factory(uint16_t, const ofp_factory<ofp_stats_request>&);
 
 private:
-    typedef boost::unordered_map<uint16_t, factory_t> factory_map_t;
-    static factory_map_t factory_map;
+    /* Indexed by ofp_factory_slot<N_FACTORIES>() */
+    static const std::size_t N_FACTORIES = 16;
+    static ofp_factory<ofp_stats_request> factory_table[N_FACTORIES + 1];
 };
 
 class ofp_stats_reply : public ofp_stats
@@ -1473,12 +1597,13 @@ public:
         return OFPT_STATS_REPLY;
     }
 
-    void factory(ofp_archive_type, ofp_stats_reply*);
-    static void register_factory(uint16_t, factory_t);
+    template<class Archive> void factory(Archive&, ofp_stats_reply*);
+    static void register_factory(uint16_t, const ofp_factory<ofp_stats_reply>&);
 
 private:
-    typedef boost::unordered_map<uint16_t, factory_t> factory_map_t;
-    static factory_map_t factory_map;
+    /* Indexed by ofp_factory_slot<N_FACTORIES>() */
+    static const std::size_t N_FACTORIES = 16;
+    static ofp_factory<ofp_stats_reply> factory_table[N_FACTORIES + 1];
 };
 
 class ofp_desc_stats_request : public ofp_stats_request
@@ -1651,11 +1776,11 @@ public:
         return OFPST_VENDOR;
     }
 
-    void factory(ofp_archive_type, ofp_vendor_stats_request*);
-    static void register_factory(uint32_t, factory_t);
+    template<class Archive> void factory(Archive&, ofp_vendor_stats_request*);
+    static void register_factory(uint32_t, const ofp_factory<ofp_vendor_stats_request>&);
 
 private:
-    typedef boost::unordered_map<uint32_t, factory_t> factory_map_t;
+    typedef boost::unordered_map<uint32_t, ofp_factory<ofp_vendor_stats_request> > factory_map_t;
     static factory_map_t factory_map;
 
     OFDEFMEM(uint32_t, vendor);
@@ -1822,11 +1947,11 @@ public:
         return OFPST_VENDOR;
     }
 
-    void factory(ofp_archive_type, ofp_vendor_stats_reply*);
-    static void register_factory(uint32_t, factory_t);
+    template<class Archive> void factory(Archive&, ofp_vendor_stats_reply*);
+    static void register_factory(uint32_t, const ofp_factory<ofp_vendor_stats_reply>&);
 
 private:
-    typedef boost::unordered_map<uint32_t, factory_t> factory_map_t;
+    typedef boost::unordered_map<uint32_t, ofp_factory<ofp_vendor_stats_reply> > factory_map_t;
     static factory_map_t factory_map;
 
     OFDEFMEM(uint32_t, vendor);
@@ -1847,14 +1972,9 @@ public:
           actions_len_(0)
     {
         buffer_id(-1);
-        in_port(ofp_phy_port::OFPP_NONE),
-                packet_buf_ = boost::asio::buffer(packet_, 0);
-    }
-    ofp_packet_out(ofp_msg& msg) : ofp_msg(msg)
-    {
-        packet_buf_ =
-            boost::asio::buffer(packet_, 0);
+        in_port(ofp_phy_port::OFPP_NONE);
     }
+    ofp_packet_out(ofp_msg& msg) : ofp_msg(msg) {}
 
     static std::size_t min_bytes() {
         return 16;
@@ -1883,15 +2003,19 @@ public:
         return *this;
     }
 
+    /* Save all of the message but its packet, for the caller to send
+     * from where it lies */
+    template<class Archive> void save_head(Archive&) const;
+
     OFDEFMEM(uint32_t, buffer_id);          /* ID assigned by datapath (-1 if none). */
     OFDEFMEM(uint16_t, in_port);            /* Packet's input port (OFPP_NONE if none). */
     OFDEFMEM(uint16_t, actions_len);        /* Size of action array in bytes. */
     ofp_action_list actions_;               /* Actions. */
-    uint8_t packet_[OFP_MAX_PACKET_BYTES];  /* Packet data.  The length is inferred
+    /* Defined by Amin */
+    boost::asio::const_buffer packet_buf_;  /* Packet data.  The length is inferred
                                                from the length field in the header.
                                                (Only meaningful if buffer_id == -1.) */
-    /* Defined by Amin */
-    boost::asio::const_buffer packet_buf_;
+    boost::shared_array<uint8_t> storage_;  /* Packet data not loaded in place. */
 };
 
 // 3.7. Barrier Messages
@@ -1946,14 +2070,8 @@ public:
 
     ofp_packet_in()
         : ofp_msg(OFPT_PACKET_IN, OFP_PACKET_IN_BYTES), buffer_id_(0),
-          total_len_(0), in_port_(0), reason_(0), pad_(0)
-    {
-        packet_buf_ = boost::asio::buffer(packet_, 0);
-    }
-    ofp_packet_in(ofp_msg& msg) : ofp_msg(msg)
-    {
-        packet_buf_ = boost::asio::buffer(packet_, length() - min_bytes());
-    }
+          total_len_(0), in_port_(0), reason_(0), pad_(0) {}
+    ofp_packet_in(ofp_msg& msg) : ofp_msg(msg) {}
 
     static std::size_t min_bytes() {
         return 18;
@@ -1964,6 +2082,9 @@ public:
         return OFPT_PACKET_IN;
     }
 
+    /* The frame of a received packet_in lies in the receive buffer of its
+     * datapath: it is only valid while the message is being dispatched,
+     * and must be copied by handlers keeping it for later. */
     const boost::asio::const_buffer& packet() const
     {
         return packet_buf_;
@@ -1981,14 +2102,11 @@ private:
     OFDEFMEM(uint16_t, in_port);      /* Port on which frame was received. */
     OFDEFMEM(uint8_t, reason);        /* Reason packet is being sent (one of OFPR_*) */
     OFDEFMEM(uint8_t, pad);
-    uint8_t packet_[OFP_MAX_PACKET_BYTES];       /* Ethernet frame, halfway through 32-bit word,
-                                                    so the IP header is 32-bit aligned.  The
-                                                    amount of data is inferred from the length
-                                                    field in the header.  Because of padding,
-                                                    offsetof(class ofp_packet_in, data) ==
-                                                    sizeof(class ofp_packet_in) - 2. */
     /* Defined by Amin */
-    boost::asio::const_buffer packet_buf_;
+    boost::asio::const_buffer packet_buf_;  /* Ethernet frame.  The amount of data
+                                               is inferred from the length field
+                                               in the header. */
+    boost::shared_array<uint8_t> storage_;  /* Frame not loaded in place. */
 };
 
 /* Flow removed (datapath -> controller). */
@@ -2182,14 +2300,17 @@ public:
         return OFPT_ERROR;
     }
 
+    const boost::asio::const_buffer& data() const
+    {
+        return data_buf_;
+    }
 
 private:
     OFDEFMEM(uint16_t, type);
     OFDEFMEM(uint16_t, code);
-    uint8_t data_[OFP_MAX_MSG_BYTES]; /* Variable-length data.  Interpreted based
-                                   on the type and code. */
-    /* Defined by Amin */
-    std::size_t data_size_;
+    boost::asio::const_buffer data_buf_;    /* Variable-length data.  Interpreted based
+                                               on the type and code. */
+    boost::shared_array<uint8_t> storage_;  /* Data not loaded in place. */
 };
 
 //
@@ -2234,10 +2355,9 @@ public:
     }
 
 private:
-    uint8_t payload_[OFP_MAX_PACKET_BYTES];
     /* Defined by Amin */
     boost::asio::const_buffer payload_buf_;
-
+    boost::shared_array<uint8_t> storage_;  /* Payload not loaded in place. */
 };
 
 class ofp_echo_reply : public ofp_msg
@@ -2261,6 +2381,7 @@ private:
     /* Defined by Amin */
     // TODO: assumes it always points to the request payload
     boost::asio::const_buffer payload_buf_;
+    boost::shared_array<uint8_t> storage_;  /* Payload not loaded in place. */
 };
 
 /* Vendor extension. */
@@ -2289,12 +2410,12 @@ public:
         return OFPT_VENDOR;
     }
 
-    void factory(ofp_archive_type, ofp_vendor*);
-    static void register_factory(uint32_t, factory_t);
+    template<class Archive> void factory(Archive&, ofp_vendor*);
+    static void register_factory(uint32_t, const ofp_factory<ofp_vendor>&);
 
     OFDEFMEM(uint32_t, vendor);
 private:
-    typedef boost::unordered_map<uint32_t, factory_t> factory_map_t;
+    typedef boost::unordered_map<uint32_t, ofp_factory<ofp_vendor> > factory_map_t;
     static factory_map_t factory_map;
 };
 
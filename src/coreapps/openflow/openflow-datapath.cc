@@ -19,6 +19,8 @@
 #include "openflow-datapath.hh"
 
 #include <config.h>
+#include <time.h>
+#include <algorithm>
 #include <iostream>
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/bind.hpp>
@@ -28,9 +30,13 @@
 #include <boost/iostreams/stream.hpp>
 #include <boost/iostreams/device/array.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/thread/locks.hpp>
 #include <boost/timer.hpp>
+#include <boost/type_traits/aligned_storage.hpp>
+#include <boost/type_traits/alignment_of.hpp>
 
 #include "assert.hh"
+#include "batch-event.hh"
 #include "openflow-datapath-join-event.hh"
 #include "openflow-datapath-leave-event.hh"
 #include "openflow-event.hh"
@@ -67,6 +73,37 @@ Openflow_datapath::handshake_state_desc[Openflow_datapath::HANDSHAKE_NSTATES] =
     "checking switch auth"
 };
 
+__thread Cork* Cork::outermost = 0;
+
+Cork::Cork()
+{
+    if (!outermost)
+    {
+        outermost = this;
+    }
+}
+
+Cork::~Cork()
+{
+    if (outermost != this)
+    {
+        return;
+    }
+    outermost = 0;
+    BOOST_FOREACH(const boost::shared_ptr<Openflow_datapath>& dp, corked)
+    {
+        dp->flush();
+    }
+}
+
+static uint64_t
+now_us()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
 size_t hash_value(const Openflow_datapath& dp)
 {
     boost::hash<datapathid> h;
@@ -77,14 +114,16 @@ Openflow_datapath::Openflow_datapath(Openflow_manager& mgr)
     : datapath_state(HANDSHAKE), handshake_state(HELLO), manager(mgr),
       header_set(false), hello_received(false), features_req_sent(false),
       probe_interval(15),//, idle_timer(io_service),
-      rx_buf(new ba::streambuf(512 * 1024)),
+      rx_buf(new ba::streambuf(RX_BUF_SIZE)),
       tx_buf_active(new ba::streambuf(1024 * 1024)),
       tx_buf_pending(new ba::streambuf(1024 * 1024)),
       oa_active(new network_oarchive(*tx_buf_active)),
       oa_pending(new network_oarchive(*tx_buf_pending)),
-      ia(*rx_buf),
-      is_sending(false)
+      ia(new network_iarchive(*rx_buf)),
+      is_sending(false), corked(false), corked_at(0), rx_size(RX_MIN_SIZE), rx_requested(0),
+      rx_reserved(0), rx_small_reads(0)
 {
+    rx_batch.reserve(MAX_BATCH);
     /*
     manager.register_handler("ofp_error_msg",
             boost::bind(&Openflow_datapath::handle_error_msg, shared_from_this(), _1));
@@ -112,10 +151,7 @@ Openflow_datapath::set_connection(boost::shared_ptr<Connection> conn)
         boost::bind(&Openflow_datapath::send_cb, shared_from_this(), _1);
     connection->register_cb(ccb, rcb, scb);
 
-    connection->recv(
-        //ba::buffer(raw_rx_buf, sizeof raw_rx_buf)
-        rx_buf->prepare(rx_buf->max_size() - rx_buf->size())
-    );
+    resume_recv();
 }
 
 void
@@ -136,18 +172,29 @@ void
 Openflow_datapath::recv_cb(const size_t& bytes_transferred)
 {
     VLOG_DBG(lg, "recv %zu", bytes_transferred);
+    // Whatever the handlers send in answer goes out once they are done
+    Cork cork;
     rx_buf->commit(bytes_transferred);
+    resize_rx(bytes_transferred);
     // Process all the fully received messages
     while (rx_buf->size() >= v1::OFP_HEADER_BYTES)
     {
         if (!header_set)
         {
             ofm.clear();
-            ia >> ofm;
+            *ia >> ofm;
             header_set = true;
         }
 
-        assert(ofm.length() != 0 && ofm.length() <= v1::OFP_MAX_MSG_BYTES);
+        if (ofm.length() < v1::OFP_HEADER_BYTES)
+        {
+            VLOG_WARN(lg, "%s: message length %u under its header, closing",
+                      connection->to_string().c_str(), ofm.length());
+            flush_batch();
+            close();
+            return;
+        }
+        assert(ofm.length() <= v1::OFP_MAX_MSG_BYTES);
 
         // Have not yet received the whole message
         if (rx_buf->size() < ofm.length() - v1::OFP_HEADER_BYTES)
@@ -158,22 +205,151 @@ Openflow_datapath::recv_cb(const size_t& bytes_transferred)
         header_set = false;
 
         // Raw memory to construct ofp* object in place.
-        char raw_buf[v1::OFP_MAX_MSG_BYTES];
-        v1::ofp_msg* msg = reinterpret_cast<v1::ofp_msg*>(raw_buf);
+        const size_t slot = rx_batch.size();
+        if (slot == rx_slots.size())
+        {
+            rx_slots.push_back(boost::shared_ptr<Arena>(new Arena));
+        }
+        Arena& arena = *rx_slots[slot];
+        arena.reset();
+        v1::ofp_msg* msg = reinterpret_cast<v1::ofp_msg*>(
+            arena.allocate(v1::OFP_MAX_MSG_OBJECT_BYTES));
+
+        ia->set_arena(&arena);
+        const size_t body = ofm.length() - v1::OFP_HEADER_BYTES;
+        const size_t before = rx_buf->size();
+        ofm.factory(*ia, msg);
+        connection->get_stats().received_msg();
+
+        // Keep the framing whatever the message's own lengths said: what
+        // it left unread is skipped, and a message that read into the
+        // next one leaves nothing to resynchronize on
+        const size_t loaded = before - rx_buf->size();
+        if (loaded < body)
+        {
+            VLOG_DBG(lg, "%s: skipping %zu bytes left unread", msg->name(),
+                     body - loaded);
+            rx_buf->consume(body - loaded);
+        }
+        else if (loaded > body)
+        {
+            VLOG_WARN(lg, "%s: malformed %s, closing",
+                      connection->to_string().c_str(), msg->name());
+            flush_batch();
+            close();
+            return;
+        }
 
-        ofm.factory(ia, msg);
+        if (datapath_state != CONNECTED)
+        {
+            flush_batch();
+            handle_message(msg);
+            continue;
+        }
+
+        // Keepalives and the like do not wait for the batch
+        if (manager.is_high_priority(msg->event_type()))
+        {
+            handle_message(msg);
+            continue;
+        }
 
-        handle_message(msg);
+        VLOG_DBG(lg, "received %s", msg->name());
+        if (slot > 0 && rx_batch.front()->event_type() != msg->event_type())
+        {
+            flush_batch();
+            rx_slots[0].swap(rx_slots[slot]);
+        }
+        rx_batch.push_back(msg);
+        if (rx_batch.size() == MAX_BATCH)
+        {
+            flush_batch();
+        }
+    }
+    flush_batch();
+
+    // Hold off reading while the event queues are backed up
+    if (manager.is_paused())
+    {
+        manager.when_ready(boost::bind(&Openflow_datapath::resume_recv,
+                                       shared_from_this()));
+        return;
+    }
+    resume_recv();
+}
+
+void
+Openflow_datapath::resume_recv()
+{
+    // Everything received has been handled: drop an oversized buffer
+    if (rx_buf->size() == 0 && rx_reserved > 2 * rx_size)
+    {
+        rx_buf.reset(new ba::streambuf(RX_BUF_SIZE));
+        ia.reset(new network_iarchive(*rx_buf));
+        rx_reserved = 0;
     }
 
-    connection->recv(
-        rx_buf->prepare(rx_buf->max_size() - rx_buf->size())
-    );
+    rx_requested = std::min(rx_size, rx_buf->max_size() - rx_buf->size());
+    rx_reserved = std::max(rx_reserved, rx_buf->size() + rx_requested);
+    connection->recv(rx_buf->prepare(rx_requested));
+}
+
+void
+Openflow_datapath::resize_rx(size_t bytes_transferred)
+{
+    if (bytes_transferred == rx_requested)
+    {
+        rx_size = rx_size < RX_BUF_SIZE / 2 ? 2 * rx_size : RX_BUF_SIZE;
+        rx_small_reads = 0;
+    }
+    else if (bytes_transferred < rx_requested / 4)
+    {
+        if (++rx_small_reads == RX_SHRINK_AFTER)
+        {
+            rx_size = rx_size > 2 * RX_MIN_SIZE ? rx_size / 2 : RX_MIN_SIZE;
+            rx_small_reads = 0;
+        }
+    }
+    else
+    {
+        rx_small_reads = 0;
+    }
+}
+
+void
+Openflow_datapath::flush_batch()
+{
+    if (rx_batch.empty())
+    {
+        return;
+    }
+
+    typedef boost::aligned_storage<
+        sizeof(Openflow_event),
+        boost::alignment_of<Openflow_event>::value>::type Event_storage;
+
+    Event_storage storage[MAX_BATCH];
+    const Event* events[MAX_BATCH];
+    const size_t n = rx_batch.size();
+    for (size_t i = 0; i < n; i++)
+    {
+        events[i] = new (&storage[i]) Openflow_event(*this, rx_batch[i]);
+    }
+
+    manager.dispatch_batch(Batch_event(events[0]->get_type(),
+                                       events, events + n));
+
+    for (size_t i = 0; i < n; i++)
+    {
+        static_cast<const Openflow_event*>(events[i])->~Openflow_event();
+    }
+    rx_batch.clear();
 }
 
 void
 Openflow_datapath::send_cb(const size_t& bytes_transferred)
 {
+    boost::lock_guard<boost::mutex> lock(tx_mutex);
     assert(is_sending);
     tx_buf_active->consume(bytes_transferred);
     VLOG_DBG(lg, "sent %zu remaining %zu %zu", bytes_transferred,
@@ -195,16 +371,56 @@ Openflow_datapath::send(const v1::ofp_msg* msg)
 {
     VLOG_DBG(lg, "sending %s", msg->name());
     assert(msg->length() <= v1::OFP_MAX_MSG_BYTES);
-    
+
+    boost::lock_guard<boost::mutex> lock(tx_mutex);
+
+    // Unless held back by a Cork, a message sent with nothing queued is
+    // written right away
+    const bool corking = manager.get_cork_max_delay() >= 0 && Cork::current();
+    if (!corking && !is_sending && tx_buf_active->size() == 0
+        && tx_buf_pending->size() == 0)
+    {
+        connection->get_stats().sent_msg();
+        return send_now(msg);
+    }
+
     // Return 0 if not enough space in the buffer
     if (msg->length() > tx_buf_pending->max_size() - tx_buf_pending->size()) {
         return 0;
     }
 
     const_cast<v1::ofp_msg*>(msg)->factory(*oa_pending, NULL);
+    return queued(msg->length());
+}
+
+/* Account for a message of 'length' bytes just added to the pending
+ * buffer, with 'tx_mutex' held, and see it written: with the messages held
+ * back by a Cork, or as soon as the connection takes it. */
+size_t
+Openflow_datapath::queued(size_t length)
+{
+    Connection_stats& stats = connection->get_stats();
+    stats.sent_msg();
+    stats.queued(tx_buf_active->size() + tx_buf_pending->size());
+
+    const long max_delay = manager.get_cork_max_delay();
+    if (max_delay >= 0 && Cork::current())
+    {
+        if (!corked)
+        {
+            corked = true;
+            corked_at = now_us();
+            Cork::current()->add(shared_from_this());
+        }
+        else if (now_us() - corked_at > uint64_t(max_delay))
+        {
+            write_pending();
+        }
+        return length;
+    }
 
     if (is_sending)
-        return msg->length();
+        return length;
 
     if (tx_buf_active->size() == 0 && tx_buf_pending->size() > 0) {
         tx_buf_active.swap(tx_buf_pending);
@@ -217,9 +433,99 @@ Openflow_datapath::send(const v1::ofp_msg* msg)
         connection->send(*tx_buf_active);
     }
 
+    return length;
+}
+
+/* Write 'msg' right away, with nothing else queued.  The message is
+ * serialized into the empty pending buffer, except for the payload of a
+ * packet-out which is written from where it lies, in the same writev().
+ * Whatever the socket does not take is queued as by send(). */
+size_t
+Openflow_datapath::send_now(const v1::ofp_msg* msg)
+{
+    ba::const_buffer payload;
+    if (msg->type() == v1::ofp_msg::OFPT_PACKET_OUT)
+    {
+        // The header keeps the full length; the message is left as is,
+        // as other threads may be sending it too
+        const v1::ofp_packet_out* po =
+            static_cast<const v1::ofp_packet_out*>(msg);
+        payload = po->packet();
+        po->save_head(*oa_pending);
+    }
+    else
+    {
+        const_cast<v1::ofp_msg*>(msg)->factory(*oa_pending, NULL);
+    }
+
+    Connection::Const_buffers buffers;
+    buffers.push_back(*tx_buf_pending->data().begin());
+    buffers.push_back(payload);
+    const size_t head = tx_buf_pending->size();
+    const size_t total = head + ba::buffer_size(payload);
+
+    boost::system::error_code ec;
+    size_t n = connection->send_some(buffers, ec);
+    if (ec)
+    {
+        // Let the asynchronous send report any error
+        n = 0;
+    }
+    if (n == total)
+    {
+        tx_buf_pending->consume(head);
+        return msg->length();
+    }
+
+    // Queue the rest, copying the part of the payload left over
+    tx_buf_pending->consume(std::min(n, head));
+    const size_t sent = n > head ? n - head : 0;
+    tx_buf_pending->sputn(ba::buffer_cast<const char*>(payload) + sent,
+                          ba::buffer_size(payload) - sent);
+
+    tx_buf_active.swap(tx_buf_pending);
+    oa_active.swap(oa_pending);
+    connection->get_stats().queued(tx_buf_active->size());
+    is_sending = true;
+    connection->send(*tx_buf_active);
     return msg->length();
 }
 
+void
+Openflow_datapath::flush()
+{
+    boost::lock_guard<boost::mutex> lock(tx_mutex);
+    write_pending();
+}
+
+/* Write the pending buffer in one go, with 'tx_mutex' held.  Unless a send
+ * is in progress: its completion picks the pending buffer up. */
+void
+Openflow_datapath::write_pending()
+{
+    corked = false;
+    if (is_sending || tx_buf_pending->size() == 0)
+    {
+        return;
+    }
+
+    tx_buf_active.swap(tx_buf_pending);
+    oa_active.swap(oa_pending);
+
+    Connection::Const_buffers buffers(1, *tx_buf_active->data().begin());
+    boost::system::error_code ec;
+    const size_t n = connection->send_some(buffers, ec);
+    if (!ec)
+    {
+        tx_buf_active->consume(n);
+    }
+    if (tx_buf_active->size() > 0)
+    {
+        is_sending = true;
+        connection->send(*tx_buf_active);
+    }
+}
+
 void
 Openflow_datapath::handle_message(const v1::ofp_msg* msg)
 {
@@ -289,6 +595,7 @@ Openflow_datapath::handle_handshake(const Event& e)
         auto ofr = assert_cast<const v1::ofp_features_reply*>(ofe.msg);
 
         features = *ofr;
+        features.own_ports();
         id_ = datapathid::from_host(features.datapath_id());
 
         // TODO: fix this
@@ -19,17 +19,21 @@
 #ifndef OPENFLOW_CONNECTION_HH
 #define OPENFLOW_CONNECTION_HH 1
 
+#include <vector>
 #include <boost/asio/streambuf.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/shared_ptr.hpp>
 
+#include "arena.hh"
 #include "connection.hh"
 #include "openflow-manager.hh"
 #include "netinet++/datapathid.hh"
 #include "network_iarchive.hh"
 #include "network_oarchive.hh"
 #include <openflow/openflow-1.0.hh>
+#include <openflow/openflow-writer-1.0.hh>
 
 namespace vigil
 {
@@ -37,6 +41,36 @@ namespace openflow
 {
 
 class Openflow_manager;
+class Openflow_datapath;
+
+/* While a Cork lives on a thread, the messages sent from that thread are
+ * held in the send buffer of their datapath, and each datapath is written
+ * once, when the outermost Cork goes away: a flow_mod and a packet_out
+ * sent in answer to a packet_in leave in a single write.  Messages held
+ * longer than the manager's cork-max-delay are written with the next
+ * message sent to the same datapath. */
+class Cork
+    : boost::noncopyable
+{
+public:
+    Cork();
+    ~Cork();
+
+    /* The outermost Cork of this thread, if any */
+    static Cork* current()
+    {
+        return outermost;
+    }
+
+    void add(const boost::shared_ptr<Openflow_datapath>& dp)
+    {
+        corked.push_back(dp);
+    }
+
+private:
+    static __thread Cork* outermost;
+    std::vector<boost::shared_ptr<Openflow_datapath> > corked;
+};
 
 class Openflow_datapath
     : public boost::enable_shared_from_this<Openflow_datapath>,
@@ -56,6 +90,54 @@ public:
     void close() const;
     size_t send(const v1::ofp_msg*);
 
+    /* Holds the send buffer of a datapath while a message is written into
+     * it in place by a v1::ofp_writer, rather than built as an object:
+     *
+     *     Openflow_datapath::Send_lock lock(dp);
+     *     v1::ofp_flow_mod_writer fm(lock.buffer(), match);
+     *     fm.idle_timeout(5).action_output(port);
+     *     lock.send(fm);
+     *
+     * send() then goes on as Openflow_datapath::send() would.  No other
+     * message can be sent to the datapath, from any thread, while the
+     * lock is held. */
+    class Send_lock
+        : boost::noncopyable
+    {
+    public:
+        explicit Send_lock(Openflow_datapath& dp_)
+            : dp(dp_), lock(dp_.tx_mutex) {}
+
+        boost::asio::streambuf& buffer()
+        {
+            return *dp.tx_buf_pending;
+        }
+
+        size_t send(v1::ofp_writer& writer)
+        {
+            const size_t length = writer.commit();
+            return length ? dp.queued(length) : 0;
+        }
+
+    private:
+        Openflow_datapath& dp;
+        boost::lock_guard<boost::mutex> lock;
+    };
+
+    /* Write the messages held back by a Cork */
+    void flush();
+
+    const boost::shared_ptr<Connection>& get_connection() const
+    {
+        return connection;
+    }
+
+    /* Traffic counters of the connection to the datapath */
+    const Connection_stats& get_stats() const
+    {
+        return connection->get_stats();
+    }
+
     bool operator==(const Openflow_datapath& that) const
     {
         return id_ == that.id_;
@@ -101,6 +183,8 @@ private:
     bool hello_received;
     bool features_req_sent;
     v1::ofp_msg ofm;
+    // The features reply, with its ports copied out of the receive slot
+    // they were decoded in
     v1::ofp_features_reply features;
 
     // ID of joining switch
@@ -117,14 +201,45 @@ private:
     std::unique_ptr<boost::asio::streambuf> tx_buf_pending;
     std::unique_ptr<network_oarchive> oa_active;
     std::unique_ptr<network_oarchive> oa_pending;
-    network_iarchive ia;
+    std::unique_ptr<network_iarchive> ia;
     bool is_sending;
+    // Messages are held back by a Cork, since 'corked_at' (microseconds)
+    bool corked;
+    uint64_t corked_at;
+
+    // Reads are sized to the traffic seen: 'rx_size' doubles each time a
+    // read fills it, and halves after RX_SHRINK_AFTER reads in a row using
+    // less than a quarter of it.  The receive buffer keeps the memory of
+    // the largest read it took, 'rx_reserved', until it is found empty and
+    // oversized, and replaced; idle datapaths thus give their memory back.
+    static const size_t RX_BUF_SIZE = 512 * 1024;
+    static const size_t RX_MIN_SIZE = 4096;
+    static const unsigned RX_SHRINK_AFTER = 8;
+    size_t rx_size;
+    size_t rx_requested;
+    size_t rx_reserved;
+    unsigned rx_small_reads;
+
+    // Consecutive messages of the same type received in one read are
+    // dispatched together, up to MAX_BATCH at a time.  Each message of the
+    // batch is constructed in an arena of its own, along with its action
+    // or port lists; arenas are allocated as bursts grow and kept for
+    // later reads.
+    static const size_t MAX_BATCH = 32;
+    std::vector<boost::shared_ptr<Arena> > rx_slots;
+    std::vector<const v1::ofp_msg*> rx_batch;
 
     void close_cb();
     void recv_cb(const size_t&);
+    void resume_recv();
+    void resize_rx(size_t bytes_transferred);
     void send_cb(const size_t&);
 
+    size_t send_now(const v1::ofp_msg*);
+    size_t queued(size_t length);
+    void write_pending();
     void handle_message(const v1::ofp_msg* msg);
+    void flush_batch();
     Disposition handle_disconnect(const Event&);
     Disposition handle_error_msg(const Event&);
     Disposition handle_handshake(const Event&);
@@ -142,13 +142,12 @@ const unsigned int OFP_VENDOR_HEADER_BYTES = 12;
 const unsigned int OFP_MAX_XID = 0x7FFFFFFF;
 const unsigned int OFP_MAX_LEN = UINT16_MAX;
 const unsigned int OFP_MAX_MSG_BYTES = 64 * 1024;
+// Upper bounds on the size of the objects decoded messages are built in,
+// not of their wire format.  Variable-length parts (packet data, action
+// and port lists, ...) live outside the objects, sized to the message.
+const unsigned int OFP_MAX_MSG_OBJECT_BYTES = 2048;
 const unsigned int OFP_MAX_ACTION_BYTES = UINT8_MAX;
-const unsigned int OFP_MAX_ACTION_COUNT = 64;
-const unsigned int OFP_MAX_PACKET_BYTES = 9 * 1024 + 128;
-const unsigned int OFP_MAX_QUEUES = 1024;
 const unsigned int OFP_MAX_QUEUE_PROP_BYTES = 64;
-const unsigned int OFP_MAX_QUEUE_PROP_COUNT = 64;
-const unsigned int OFP_MAX_STATS_PER_REPLY = 64;
 
 // TODO: imported -- fix
 /** Send flow removed messages
@@ -24,6 +24,7 @@
 
 #include "event.hh"
 #include "openflow-datapath.hh"
+#include "typed-event-handler.hh"
 
 namespace vigil
 {
@@ -34,7 +35,7 @@ class Openflow_event : public Event
 {
 public:
     Openflow_event(Openflow_datapath& dp_,
-                   const v1::ofp_msg* msg_) : Event(msg_->name()), dp(dp_), msg(msg_) {}
+                   const v1::ofp_msg* msg_) : Event(msg_->event_type()), dp(dp_), msg(msg_) {}
 
     ~Openflow_event() { }
 
@@ -43,7 +44,52 @@ public:
     const v1::ofp_msg* msg;
 };
 
+/* Typed view of an Openflow_event carrying a message of class 'Msg', for
+ * typed handlers:
+ *
+ *   Disposition handle_echo_request(const Openflow_echo_request_event&);
+ *   ...
+ *   register_handler<Openflow_echo_request_event>(&C::handle_echo_request);
+ *
+ * The view only refers to the datapath and the message of the event, so it
+ * must not outlive the handler invocation. */
+template <typename Msg>
+class Openflow_msg_event
+{
+public:
+    explicit Openflow_msg_event(const Openflow_event& ofe)
+        : dp(ofe.dp), msg(*static_cast<const Msg*>(ofe.msg)) { }
+
+    static const Event_name static_get_name()
+    {
+        return Msg::static_get_name();
+    }
+
+    Openflow_datapath& dp;
+
+    const Msg& msg;
+};
+
+typedef Openflow_msg_event<v1::ofp_echo_request> Openflow_echo_request_event;
+typedef Openflow_msg_event<v1::ofp_error_msg> Openflow_error_msg_event;
+typedef Openflow_msg_event<v1::ofp_features_reply> Openflow_features_reply_event;
+typedef Openflow_msg_event<v1::ofp_flow_removed> Openflow_flow_removed_event;
+typedef Openflow_msg_event<v1::ofp_packet_in> Openflow_packet_in_event;
+typedef Openflow_msg_event<v1::ofp_port_status> Openflow_port_status_event;
+
 } // namespace openflow
+
+template <typename Msg>
+struct Event_traits<openflow::Openflow_msg_event<Msg> >
+{
+    typedef openflow::Openflow_msg_event<Msg> argument_type;
+
+    static argument_type convert(const Event& event)
+    {
+        return argument_type(static_cast<const openflow::Openflow_event&>(event));
+    }
+};
+
 } // namespace vigil
 
 #endif  // -- OFP_MSG_EVENT_HH
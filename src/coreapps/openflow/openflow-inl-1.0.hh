@@ -47,6 +47,7 @@
 #include <boost/utility/enable_if.hpp>
 
 #include "packets.h"
+#include "wire-layout.hh"
 
 namespace vigil
 {
@@ -57,17 +58,101 @@ namespace v1
 
 namespace bs = boost::serialization;
 
-// Factory
-template<typename T>
-struct has_factory
+// Memory for the variable-length part of an object being loaded.  It
+// comes from the arena of a network archive if it has one, and is then
+// reclaimed along with the object; otherwise it is taken from the heap
+// and held by 'storage'.
+template<class Archive>
+inline uint8_t* load_storage(Archive&, boost::shared_array<uint8_t>& storage,
+                             std::size_t size)
 {
-    template <typename C> static char test(typeof(&C::factory()));
-    template <typename C> static long test(...);
+    storage.reset(new uint8_t[size]);
+    return storage.get();
+}
 
-public:
-    enum { value = sizeof(test<T>(0)) == sizeof(char) };
+inline uint8_t* load_storage(network_iarchive& ar,
+                             boost::shared_array<uint8_t>& storage,
+                             std::size_t size)
+{
+    if (Arena* arena = ar.get_arena())
+    {
+        storage.reset();
+        return static_cast<uint8_t*>(arena->allocate(size));
+    }
+    return load_storage<network_iarchive>(ar, storage, size);
+}
+
+// 'size' bytes to load, cut down to what a network archive has left: a
+// length field claiming more than was received is not trusted with reads
+// past the buffer, nor with allocations.  Whatever a message loads beyond
+// its own length is caught by Openflow_datapath::recv_cb().
+template<class Archive>
+inline std::size_t load_bound(Archive&, std::size_t size)
+{
+    return size;
+}
+
+inline std::size_t load_bound(network_iarchive& ar, std::size_t size)
+{
+    return std::min(size, ar.size());
+}
+
+// Point 'buf' at the next 'size' bytes of the archive.  A network archive
+// reads from a contiguous buffer, so the bytes are left where they lie;
+// other archives copy them into 'storage'.
+template<class Archive>
+inline void load_buffer(Archive& ar, boost::asio::const_buffer& buf,
+                        boost::shared_array<uint8_t>& storage, std::size_t size)
+{
+    uint8_t* data = load_storage(ar, storage, size);
+    ar& bs::make_binary_object(data, size);
+    buf = boost::asio::buffer(data, size);
+}
+
+inline void load_buffer(network_iarchive& ar, boost::asio::const_buffer& buf,
+                        boost::shared_array<uint8_t>& storage, std::size_t size)
+{
+    storage.reset();
+    size = load_bound(ar, size);
+    buf = boost::asio::buffer(ar.load_view(size), size);
+}
+
+// Save the bytes of 'buf'
+template<class Archive>
+inline void save_buffer(Archive& ar, const boost::asio::const_buffer& buf)
+{
+    const uint8_t* data = boost::asio::buffer_cast<const uint8_t*>(buf);
+    ar& bs::make_binary_object(const_cast<uint8_t*>(data),
+                               boost::asio::buffer_size(buf));
+}
+
+// Upper bound on the size of the objects built by the factories of Base,
+// which construct them in memory of that size.
+template<class Base>
+struct max_object_bytes
+{
+    static const std::size_t value = OFP_MAX_MSG_OBJECT_BYTES;
+};
+
+template<>
+struct max_object_bytes<ofp_action>
+{
+    static const std::size_t value = OFP_MAX_ACTION_BYTES;
+};
+
+template<>
+struct max_object_bytes<ofp_action_vendor>
+{
+    static const std::size_t value = OFP_MAX_ACTION_BYTES;
 };
 
+template<>
+struct max_object_bytes<ofp_queue_prop>
+{
+    static const std::size_t value = OFP_MAX_QUEUE_PROP_BYTES;
+};
+
+// Factory
 template <typename Message>
 class serialize_visitor : public boost::static_visitor<void>
 {
@@ -84,7 +169,7 @@ private:
     Message& msg;
 };
 
-template<class Derived, class Base, class Enable = void>
+template<class Derived, class Base>
 struct construct_and_load
 {
     void
@@ -102,24 +187,33 @@ struct construct_and_load
 };
 
 template<class Derived, class Base>
-struct construct_and_load
-        <Derived, Base, typename boost::enable_if<has_factory<Derived> >::type>
+inline void load_object(network_iarchive& ar, Base* mem, Base& b)
 {
-    void
-    operator()(ofp_archive_type ar, Base* mem, Base& b)
-    {
-        if (mem != NULL) {
-            Derived d(b);
-            d.factory(ar, reinterpret_cast<Derived*>(mem));
-        } else {
-            Derived& d = reinterpret_cast<Derived&>(b);
-            d.factory(ar, NULL);
-        }
-    }
-};
+    Derived* d = ::new(mem)Derived(b);
+    d->serialize(ar, 0);
+}
+
+template<class Derived, class Base>
+inline void save_object(network_oarchive& ar, Base& b)
+{
+    reinterpret_cast<Derived&>(b).serialize(ar, 0);
+}
+
+// Factory of Derived for the table of Base, with the network archives
+// bound to Derived's serialize() at compile time
+template<class Derived, class Base>
+inline ofp_factory<Base> make_factory()
+{
+    BOOST_STATIC_ASSERT(sizeof(Derived) <= max_object_bytes<Base>::value);
+    ofp_factory<Base> f;
+    f.load = &load_object<Derived, Base>;
+    f.save = &save_object<Derived, Base>;
+    f.generic = construct_and_load<Derived, Base>();
+    return f;
+}
 
 #define REGISTER_FACTORY(T, ID); \
-    register_factory(ID, construct_and_load<T, ofp_msg>())
+    register_factory(ID, make_factory<T, ofp_msg>())
 
 inline void ofp_msg::init()
 {
@@ -149,7 +243,7 @@ inline void ofp_msg::init()
 
 #undef REGISTER_FACTORY
 #define REGISTER_FACTORY(T, ID); \
-    register_factory(ID, construct_and_load<T, ofp_stats_request>())
+    register_factory(ID, make_factory<T, ofp_stats_request>())
 
 inline void ofp_stats_request::init()
 {
@@ -164,7 +258,7 @@ inline void ofp_stats_request::init()
 
 #undef REGISTER_FACTORY
 #define REGISTER_FACTORY(T, ID); \
-    register_factory(ID, construct_and_load<T, ofp_stats_reply>())
+    register_factory(ID, make_factory<T, ofp_stats_reply>())
 
 inline void ofp_stats_reply::init()
 {
@@ -179,7 +273,7 @@ inline void ofp_stats_reply::init()
 
 #undef REGISTER_FACTORY
 #define REGISTER_FACTORY(T, ID); \
-    register_factory(ID, construct_and_load<T, ofp_vendor_stats_request>())
+    register_factory(ID, make_factory<T, ofp_vendor_stats_request>())
 
 inline void ofp_vendor_stats_request::init()
 {
@@ -187,7 +281,7 @@ inline void ofp_vendor_stats_request::init()
 
 #undef REGISTER_FACTORY
 #define REGISTER_FACTORY(T, ID); \
-    register_factory(ID, construct_and_load<T, ofp_vendor_stats_reply>())
+    register_factory(ID, make_factory<T, ofp_vendor_stats_reply>())
 
 inline void ofp_vendor_stats_reply::init()
 {
@@ -195,7 +289,7 @@ inline void ofp_vendor_stats_reply::init()
 
 #undef REGISTER_FACTORY
 #define REGISTER_FACTORY(T, ID); \
-    register_factory(ID, construct_and_load<T, ofp_action>())
+    register_factory(ID, make_factory<T, ofp_action>())
 
 inline void ofp_action::init()
 {
@@ -216,7 +310,7 @@ inline void ofp_action::init()
 
 #undef REGISTER_FACTORY
 #define REGISTER_FACTORY(T, ID); \
-    register_factory(ID, construct_and_load<T, ofp_action_vendor>())
+    register_factory(ID, make_factory<T, ofp_action_vendor>())
 
 inline void ofp_action_vendor::init()
 {
@@ -224,7 +318,7 @@ inline void ofp_action_vendor::init()
 
 #undef REGISTER_FACTORY
 #define REGISTER_FACTORY(T, ID); \
-    register_factory(ID, construct_and_load<T, ofp_queue_prop>())
+    register_factory(ID, make_factory<T, ofp_queue_prop>())
 
 inline void ofp_queue_prop::init()
 {
@@ -234,7 +328,7 @@ inline void ofp_queue_prop::init()
 
 #undef REGISTER_FACTORY
 #define REGISTER_FACTORY(T, ID); \
-    register_factory(ID, construct_and_load<T, ofp_vendor>())
+    register_factory(ID, make_factory<T, ofp_vendor>())
 
 inline void ofp_vendor::init()
 {
@@ -251,97 +345,101 @@ inline ofp_msg::factory_t ofp_msg::construct(const uint8_t* buf)
     return NULL;
 }
 */
-inline void ofp_msg::factory(ofp_archive_type ar, ofp_msg* mem)
+template<class Archive>
+inline void ofp_msg::factory(Archive& ar, ofp_msg* mem)
 {
-    return factory_map[type()](ar, mem, *this);
+    factory_table[type()](ar, mem, *this);
 }
 
-inline void ofp_msg::register_factory(uint8_t t, ofp_msg::factory_t f)
+inline void ofp_msg::register_factory(uint8_t t, const ofp_factory<ofp_msg>& f)
 {
-    factory_map[t] = f;
+    factory_table[t] = f;
 }
 
-inline void ofp_stats_request::factory(ofp_archive_type ar, ofp_stats_request* mem)
+template<class Archive>
+inline void ofp_stats_request::factory(Archive& ar, ofp_stats_request* mem)
 {
-    return factory_map[type()](ar, mem, *this);
+    factory_table[ofp_factory_slot<N_FACTORIES>(type())](ar, mem, *this);
 }
 
-inline void ofp_stats_request::register_factory(uint16_t t,
-                                                ofp_stats_request::factory_t f)
+inline void ofp_stats_request::register_factory(uint16_t t, const ofp_factory<ofp_stats_request>& f)
 {
-    factory_map[t] = f;
+    factory_table[ofp_factory_slot<N_FACTORIES>(t)] = f;
 }
 
-inline void ofp_stats_reply::factory(ofp_archive_type ar, ofp_stats_reply* mem)
+template<class Archive>
+inline void ofp_stats_reply::factory(Archive& ar, ofp_stats_reply* mem)
 {
-    return factory_map[type()](ar, mem, *this);
+    factory_table[ofp_factory_slot<N_FACTORIES>(type())](ar, mem, *this);
 }
 
-inline void ofp_stats_reply::register_factory(uint16_t t,
-                                              ofp_stats_reply::factory_t f)
+inline void ofp_stats_reply::register_factory(uint16_t t, const ofp_factory<ofp_stats_reply>& f)
 {
-    factory_map[t] = f;
+    factory_table[ofp_factory_slot<N_FACTORIES>(t)] = f;
 }
 
-inline void ofp_vendor_stats_request::factory(ofp_archive_type ar, ofp_vendor_stats_request* mem)
+template<class Archive>
+inline void ofp_vendor_stats_request::factory(Archive& ar, ofp_vendor_stats_request* mem)
 {
-    return factory_map[vendor()](ar, mem, *this);
+    factory_map[vendor()](ar, mem, *this);
 }
 
-inline void ofp_vendor_stats_request::register_factory(uint32_t t,
-                                                       ofp_vendor_stats_request::factory_t f)
+inline void ofp_vendor_stats_request::register_factory(uint32_t t, const ofp_factory<ofp_vendor_stats_request>& f)
 {
     factory_map[t] = f;
 }
 
-inline void ofp_vendor_stats_reply::factory(ofp_archive_type ar, ofp_vendor_stats_reply* mem)
+template<class Archive>
+inline void ofp_vendor_stats_reply::factory(Archive& ar, ofp_vendor_stats_reply* mem)
 {
-    return factory_map[vendor()](ar, mem, *this);
+    factory_map[vendor()](ar, mem, *this);
 }
 
-inline void ofp_vendor_stats_reply::register_factory(uint32_t t,
-                                                     ofp_vendor_stats_reply::factory_t f)
+inline void ofp_vendor_stats_reply::register_factory(uint32_t t, const ofp_factory<ofp_vendor_stats_reply>& f)
 {
     factory_map[t] = f;
 }
-inline void ofp_action::factory(ofp_archive_type ar, ofp_action* mem)
+
+template<class Archive>
+inline void ofp_action::factory(Archive& ar, ofp_action* mem)
 {
-    return factory_map[type()](ar, mem, *this);
+    factory_table[ofp_factory_slot<N_FACTORIES>(type())](ar, mem, *this);
 }
 
-inline void ofp_action::register_factory(uint16_t t, ofp_action::factory_t f)
+inline void ofp_action::register_factory(uint16_t t, const ofp_factory<ofp_action>& f)
 {
-    factory_map[t] = f;
+    factory_table[ofp_factory_slot<N_FACTORIES>(t)] = f;
 }
 
-inline void ofp_action_vendor::factory(ofp_archive_type ar, ofp_action_vendor* mem)
+template<class Archive>
+inline void ofp_action_vendor::factory(Archive& ar, ofp_action_vendor* mem)
 {
-    return factory_map[vendor()](ar, mem, *this);
+    factory_map[vendor()](ar, mem, *this);
 }
 
-inline void ofp_action_vendor::register_factory(uint32_t t,
-                                                ofp_action_vendor::factory_t f)
+inline void ofp_action_vendor::register_factory(uint32_t t, const ofp_factory<ofp_action_vendor>& f)
 {
     factory_map[t] = f;
 }
 
-inline void ofp_queue_prop::factory(ofp_archive_type ar, ofp_queue_prop* mem)
+template<class Archive>
+inline void ofp_queue_prop::factory(Archive& ar, ofp_queue_prop* mem)
 {
-    return factory_map[property()](ar, mem, *this);
+    factory_table[ofp_factory_slot<N_FACTORIES>(property())](ar, mem, *this);
 }
 
-inline void ofp_queue_prop::register_factory(uint16_t t,
-                                             ofp_queue_prop::factory_t f)
+inline void ofp_queue_prop::register_factory(uint16_t t, const ofp_factory<ofp_queue_prop>& f)
 {
-    factory_map[t] = f;
+    factory_table[ofp_factory_slot<N_FACTORIES>(t)] = f;
 }
 
-inline void ofp_vendor::factory(ofp_archive_type ar, ofp_vendor* mem)
+template<class Archive>
+inline void ofp_vendor::factory(Archive& ar, ofp_vendor* mem)
 {
-    return factory_map[vendor()](ar, mem, *this);
+    factory_map[vendor()](ar, mem, *this);
 }
 
-inline void ofp_vendor::register_factory(uint32_t t, ofp_vendor::factory_t f)
+inline void ofp_vendor::register_factory(uint32_t t, const ofp_factory<ofp_vendor>& f)
 {
     factory_map[t] = f;
 }
@@ -362,10 +460,20 @@ inline void ofp_packet_out::serialize(Archive& ar, const unsigned int)
         actions_.length(actions_len_);
     ar& actions_;
 
-    uint8_t size = length() - min_bytes() - actions_len_;
-    const uint8_t* packet = boost::asio::buffer_cast<const uint8_t*>(packet_buf_);
-    ar& bs::make_binary_object(const_cast<uint8_t*>(packet), size);
-    packet_buf_ = boost::asio::buffer(packet, size);
+    if (Archive::is_saving::value)
+        save_buffer(ar, packet_buf_);
+    else
+        load_buffer(ar, packet_buf_, storage_, length() - min_bytes() - actions_len_);
+}
+
+template<class Archive>
+inline void ofp_packet_out::save_head(Archive& ar) const
+{
+    ar& bs::base_object<ofp_msg>(*this);
+    ar& buffer_id_;
+    ar& in_port_;
+    ar& actions_len_;
+    ar& actions_;
 }
 
 template<class Archive>
@@ -409,6 +517,8 @@ inline uint32_t ofp_phy_port::speed()
 template<class Archive>
 inline void ofp_phy_port::serialize(Archive& ar, const unsigned int)
 {
+    if (serialize_bulk(ar, *this))
+        return;
     ar& port_no_;
     ar& hw_addr_;
     ar& bs::make_binary_object(name_, sizeof name_);
@@ -458,26 +568,98 @@ inline void ofp_queue_stats::serialize(Archive& ar, const unsigned int)
     ar& tx_errors_;
 }
 
+// Action lists follow the fixed layout of the structures holding them
+inline void record_member(Wire_layout::Recorder&, ofp_action_list&)
+{
+}
+
 template<class Archive>
 inline void ofp_flow_stats::serialize(Archive& ar, const unsigned int)
 {
-    ar& length_;
-    ar& table_id_;
-    ar& pad_;
-    ar& match_;
-    ar& duration_sec_;
-    ar& duration_nsec_;
-    ar& priority_;
-    ar& idle_timeout_;
-    ar& hard_timeout_;
-    ar& bs::make_binary_object(pad2_, sizeof pad2_);
-    ar& cookie_;
-    ar& packet_count_;
-    ar& byte_count_;
+    // The layout covers the fields up to the actions
+    if (!serialize_bulk(ar, *this))
+    {
+        ar& length_;
+        ar& table_id_;
+        ar& pad_;
+        ar& match_;
+        ar& duration_sec_;
+        ar& duration_nsec_;
+        ar& priority_;
+        ar& idle_timeout_;
+        ar& hard_timeout_;
+        ar& bs::make_binary_object(pad2_, sizeof pad2_);
+        ar& cookie_;
+        ar& packet_count_;
+        ar& byte_count_;
+    }
     actions_.length(length() - min_bytes());
     ar& actions_;
 }
 
+// Bytes taken by a stats entry
+template<class Type>
+inline std::size_t stats_bytes(const Type&)
+{
+    return Type::min_bytes();
+}
+
+inline std::size_t stats_bytes(const ofp_flow_stats& fs)
+{
+    return fs.length();
+}
+
+// Bytes taken by the next stats entry, read ahead of it where the archive
+// allows, so that an entry running past the list is not loaded at all
+template<class Archive, class Type>
+inline std::size_t peek_stats_bytes(Archive&, const Type*)
+{
+    return Type::min_bytes();
+}
+
+inline std::size_t peek_stats_bytes(network_iarchive& ar, const ofp_flow_stats*)
+{
+    return ar.peek_uint16(0);
+}
+
+template<class Type>
+template<class Archive>
+inline void ofp_stats_list<Type>::serialize(Archive& ar, const unsigned int)
+{
+    if (Archive::is_saving::value) {
+        for (std::size_t i = 0; i < elems_; i++) {
+            ar& list_[i];
+        }
+        return;
+    }
+
+    // For loading we rely on length to infer the size.  Every entry
+    // takes at least min_bytes() of it, which bounds their number.
+    // Loading stops at the first entry of a bad length, the rest of the
+    // list being left unread.
+    length_ = load_bound(ar, length_);
+    const std::size_t n = length_ / Type::min_bytes();
+    list_ = reinterpret_cast<Type*>(
+        load_storage(ar, storage_, n * sizeof(Type)));
+    elems_ = 0;
+
+    std::size_t byte_count = length_;
+    while (byte_count >= Type::min_bytes()) {
+        const std::size_t ahead = peek_stats_bytes(ar, list_);
+        if (ahead < Type::min_bytes() || ahead > byte_count) {
+            break;
+        }
+        Type* elem = ::new(&list_[elems_])Type();
+        ar& *elem;
+        const std::size_t bytes = stats_bytes(*elem);
+        if (bytes < Type::min_bytes() || bytes > byte_count) {
+            break;
+        }
+        elems_++;
+        byte_count -= bytes;
+    }
+}
+
 template<class Archive>
 inline void ofp_features_reply::serialize(Archive& ar, const unsigned int)
 {
@@ -489,8 +671,20 @@ inline void ofp_features_reply::serialize(Archive& ar, const unsigned int)
     ar& bs::make_binary_object(pad_, sizeof pad_);
     ar& capabilities_;
     ar& actions_;
-    n_ports_ = (length() - min_bytes()) / OFP_PHY_PORT_BYTES;
-    ar& bs::make_array(ports_, n_ports_);
+    if (Archive::is_loading::value)
+    {
+        n_ports_ = (length() - min_bytes()) / OFP_PHY_PORT_BYTES;
+        ports_ = reinterpret_cast<ofp_phy_port*>(
+            load_storage(ar, storage_, n_ports_ * sizeof(ofp_phy_port)));
+        for (std::size_t i = 0; i < n_ports_; i++)
+        {
+            ::new(&ports_[i])ofp_phy_port();
+        }
+    }
+    for (std::size_t i = 0; i < n_ports_; i++)
+    {
+        ar& ports_[i];
+    }
 }
 
 template<class Archive>
@@ -512,34 +706,61 @@ inline void ofp_action::serialize(Archive& ar, const unsigned int)
     }
 }
 
+template<class T>
 template<class Archive>
-inline void ofp_action_list::serialize(Archive& ar, const unsigned int)
+inline void ofp_list<T>::serialize_list(Archive& ar, std::size_t object_bytes)
 {
-    // For loading we rely on length to infer the size
-    std::size_t i = 0;
-    std::size_t byte_count = length_;
-    if (Archive::is_loading::value) {
-        while (byte_count > 0) {
-            ofp_action action;
-            ar& action;
-            list_[i] = reinterpret_cast<ofp_action*>(storage_[i]);
-            action.factory(ar, const_cast<ofp_action*>(list_[i]));
-            byte_count -= list_[i++]->len();
+    typedef typename boost::remove_const<T>::type Element;
+
+    if (Archive::is_saving::value) {
+        for (std::size_t i = 0; i < elems_; i++) {
+            const_cast<Element*>(list_[i])->factory(ar, NULL);
         }
-    } else {
-        while (byte_count > 0) {
-            byte_count -= list_[i]->len();
-            const_cast<ofp_action*>(list_[i++])->factory(ar, NULL);
+        return;
+    }
+
+    // For loading we rely on length to infer the size.  Every element
+    // takes at least min_bytes() of it, which bounds their number.
+    const std::size_t align = Arena::ALIGNMENT;
+    const std::size_t slot = (object_bytes + align - 1) & ~(align - 1);
+    length_ = load_bound(ar, length_);
+    const std::size_t n = length_ / Element::min_bytes();
+    const std::size_t index_bytes = (n * sizeof(T*) + align - 1) & ~(align - 1);
+    uint8_t* storage = load_storage(ar, storage_, index_bytes + n * slot);
+    list_ = reinterpret_cast<T**>(storage);
+    storage += index_bytes;
+    capacity_ = n;
+    elems_ = 0;
+    owned_.reset();
+
+    std::size_t byte_count = length_;
+    while (byte_count >= Element::min_bytes()) {
+        Element header;
+        ar& header;
+        if (header.len() < Element::min_bytes() || header.len() > byte_count) {
+            break;
         }
+        Element* elem = reinterpret_cast<Element*>(storage + elems_ * slot);
+        header.factory(ar, elem);
+        list_[elems_++] = elem;
+        byte_count -= elem->len();
     }
 }
 
+template<class Archive>
+inline void ofp_action_list::serialize(Archive& ar, const unsigned int)
+{
+    serialize_list(ar, OFP_MAX_ACTION_BYTES);
+}
+
 template<class Archive>
 inline void ofp_packet_queue::serialize(Archive& ar, const unsigned int)
 {
     ar& queue_id_;
     ar& len_;
     ar& bs::make_binary_object(pad_, sizeof pad_);
+    if (Archive::is_loading::value)
+        properties_.length(len() - min_bytes());
     ar& properties_;
 }
 
@@ -559,13 +780,17 @@ inline void ofp_error_msg::serialize(Archive& ar, const unsigned int)
         ar& bs::base_object<ofp_msg>(*this);
     ar& type_;
     ar& code_;
-    data_size_ = length() - min_bytes();
-    ar& bs::make_binary_object(data_, data_size_);
+    if (Archive::is_saving::value)
+        save_buffer(ar, data_buf_);
+    else
+        load_buffer(ar, data_buf_, storage_, length() - min_bytes());
 }
 
 template<class Archive>
 inline void ofp_match::serialize(Archive& ar, const unsigned int)
 {
+    if (serialize_bulk(ar, *this))
+        return;
     ar& wildcards_;
     ar& in_port_;
     ar& dl_src_;
@@ -583,6 +808,19 @@ inline void ofp_match::serialize(Archive& ar, const unsigned int)
     ar& tp_dst_;
 }
 
+// Bytes taken by the next queue, read ahead of it as for stats entries
+template<class Archive>
+inline std::size_t peek_queue_bytes(Archive&)
+{
+    return OFP_PACKET_QUEUE_BYTES;
+}
+
+inline std::size_t peek_queue_bytes(network_iarchive& ar)
+{
+    // After the 32-bit queue id
+    return ar.peek_uint16(4);
+}
+
 template<class Archive>
 inline void ofp_queue_get_config_reply::serialize(Archive& ar, const unsigned int)
 {
@@ -590,8 +828,33 @@ inline void ofp_queue_get_config_reply::serialize(Archive& ar, const unsigned in
         ar& bs::base_object<ofp_msg>(*this);
     ar& port_;
     ar& bs::make_binary_object(pad_, sizeof pad_);
-    n_queues_ = (length() - OFP_QUEUE_GET_CONFIG_REPLY_BYTES) / OFP_PACKET_QUEUE_BYTES;
-    ar& bs::make_array(queues_, n_queues_);
+    if (Archive::is_loading::value)
+    {
+        // Queues take at least OFP_PACKET_QUEUE_BYTES each
+        std::size_t byte_count = load_bound(
+            ar, length() - OFP_QUEUE_GET_CONFIG_REPLY_BYTES);
+        const std::size_t n = byte_count / OFP_PACKET_QUEUE_BYTES;
+        queues_ = reinterpret_cast<ofp_packet_queue*>(
+            load_storage(ar, storage_, n * sizeof(ofp_packet_queue)));
+        n_queues_ = 0;
+        while (byte_count >= OFP_PACKET_QUEUE_BYTES)
+        {
+            const std::size_t ahead = peek_queue_bytes(ar);
+            if (ahead < OFP_PACKET_QUEUE_BYTES || ahead > byte_count)
+                break;
+            ofp_packet_queue* queue = ::new(&queues_[n_queues_])ofp_packet_queue();
+            ar& *queue;
+            if (queue->len() < OFP_PACKET_QUEUE_BYTES || queue->len() > byte_count)
+                break;
+            n_queues_++;
+            byte_count -= queue->len();
+        }
+    }
+    else
+    {
+        for (std::size_t i = 0; i < n_queues_; i++)
+            ar& queues_[i];
+    }
 }
 
 template<class Archive>
@@ -777,10 +1040,15 @@ inline void ofp_packet_in::serialize(Archive& ar, const unsigned int)
     ar& in_port_;
     ar& reason_;
     ar& pad_;
-    uint8_t size = length() - min_bytes();
-    uint8_t* packet = const_cast<uint8_t*>(boost::asio::buffer_cast<const uint8_t*>(packet_buf_));
-    ar& bs::make_binary_object(packet, size);
-    packet_buf_ = boost::asio::buffer(packet, size);
+    if (Archive::is_saving::value)
+    {
+        save_buffer(ar, packet_buf_);
+    }
+    else
+    {
+        // The frame is not copied out of a receive buffer
+        load_buffer(ar, packet_buf_, storage_, length() - min_bytes());
+    }
 }
 
 template<class Archive>
@@ -827,23 +1095,7 @@ inline void ofp_table_stats::serialize(Archive& ar, const unsigned int)
 template<class Archive>
 inline void ofp_queue_prop_list::serialize(Archive& ar, const unsigned int)
 {
-    // For loading we rely on length to infer the size
-    std::size_t i = 0;
-    std::size_t byte_count = length_;
-    if (Archive::is_loading::value) {
-        while (byte_count > 0) {
-            ofp_queue_prop qp;
-            ar& qp;
-            list_[i] = reinterpret_cast<ofp_queue_prop*>(storage_[i]);
-            qp.factory(ar, const_cast<ofp_queue_prop*>(list_[i]));
-            byte_count -= list_[i++]->len();
-        }
-    } else {
-        while (byte_count > 0) {
-            byte_count -= list_[i]->len();
-            const_cast<ofp_queue_prop*>(list_[i++])->factory(ar, NULL);
-        }
-    }
+    serialize_list(ar, OFP_MAX_QUEUE_PROP_BYTES);
 }
 
 template<class Archive>
@@ -858,6 +1110,8 @@ inline void ofp_queue_prop_min_rate::serialize(Archive& ar, const unsigned int)
 template<class Archive>
 inline void ofp_port_stats::serialize(Archive& ar, const unsigned int)
 {
+    if (serialize_bulk(ar, *this))
+        return;
     ar& port_no_;
     ar& bs::make_binary_object(pad_, sizeof pad_);
     ar& rx_packets_;
@@ -1026,19 +1280,20 @@ template<class Archive>
 inline void ofp_echo_reply::serialize(Archive& ar, const unsigned int)
 {
     if (Archive::is_saving::value) ar& bs::base_object<ofp_msg>(*this);
-    const uint8_t* payload = boost::asio::buffer_cast<const uint8_t*>(payload_buf_);
-    uint8_t size = length() - min_bytes();
-    ar& bs::make_binary_object(const_cast<uint8_t*>(payload), size);
+    if (Archive::is_saving::value)
+        save_buffer(ar, payload_buf_);
+    else
+        load_buffer(ar, payload_buf_, storage_, length() - min_bytes());
 }
 
 template<class Archive>
 inline void ofp_echo_request::serialize(Archive& ar, const unsigned int)
 {
     if (Archive::is_saving::value) ar& bs::base_object<ofp_msg>(*this);
-    const uint8_t* payload = boost::asio::buffer_cast<const uint8_t*>(payload_buf_);
-    uint8_t size = length() - min_bytes();
-    ar& bs::make_binary_object(const_cast<uint8_t*>(payload), size);
-    payload_buf_ = boost::asio::buffer(payload, size);
+    if (Archive::is_saving::value)
+        save_buffer(ar, payload_buf_);
+    else
+        load_buffer(ar, payload_buf_, storage_, length() - min_bytes());
 }
 
 template<class Archive>
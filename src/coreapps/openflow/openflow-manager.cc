@@ -20,6 +20,7 @@
 
 #include <config.h>
 #include <inttypes.h>
+#include <sys/time.h>
 #include <algorithm>
 #include <utility>
 #include <boost/bind.hpp>
@@ -31,12 +32,14 @@
 #include <boost/timer.hpp>
 
 #include "assert.hh"
+#include "event-dispatcher.hh"
 #include "openflow-1.0.hh"
 #include "openflow-datapath-join-event.hh"
 #include "openflow-datapath-leave-event.hh"
 #include "openflow-event.hh"
 #include "new-connection-event.hh"
 #include "shutdown-event.hh"
+#include "string.hh"
 #include "vlog.hh"
 
 namespace vigil
@@ -47,7 +50,7 @@ namespace openflow
 static Vlog_module lg("openflow-manager");
 
 Openflow_manager::Openflow_manager(const Component_context* ctxt)
-    : Component(ctxt)
+    : Component(ctxt), cork_max_delay(-1)
 {
     VLOG_DBG(lg, "Compiled with OpenFlow 0x%x%x %s\n",
              (v1::OFP_VERSION >> 4) & 0x0f,
@@ -63,6 +66,11 @@ Openflow_manager::configure()
     register_handler<Shutdown_event>(
         boost::bind(&Openflow_manager::handle_shutdown, this, _1));
 
+    if (ctxt->get_config<bool>("cork", true))
+    {
+        cork_max_delay = ctxt->get_config<long>("cork-max-delay", 1000);
+    }
+
     v1::ofp_msg::init();
     v1::ofp_stats_request::init();
     v1::ofp_stats_reply::init();
@@ -72,6 +80,9 @@ Openflow_manager::configure()
     v1::ofp_action_vendor::init();
     v1::ofp_queue_prop::init();
     v1::ofp_vendor::init();
+
+    event_dispatcher->add_stats_section(
+        "datapaths", boost::bind(&Openflow_manager::report_stats, this));
 }
 
 void
@@ -127,8 +138,8 @@ Openflow_manager::register_default_handlers()
         boost::bind(&Openflow_manager::handle_datapath_join, this, _1));
     register_handler<Openflow_datapath_leave_event>(
         boost::bind(&Openflow_manager::handle_datapath_leave, this, _1));
-    register_handler("ofp_echo_request",
-                     boost::bind(&Openflow_manager::handle_echo_request, this, _1));
+    register_handler<Openflow_echo_request_event>(
+        &Openflow_manager::handle_echo_request);
 }
 
 Disposition
@@ -157,6 +168,91 @@ Openflow_manager::handle_new_connection(const Event& e)
     return CONTINUE;
 }
 
+/* The remote end of 'dp', if its connection is still open */
+static std::string
+peer_name(const Openflow_datapath& dp)
+{
+    try
+    {
+        return dp.get_connection()->to_string();
+    }
+    catch (const std::exception&)
+    {
+        return "disconnected";
+    }
+}
+
+static void
+get_handler_stats(const Openflow_datapath& dp,
+                  Openflow_manager::Datapath_stats& s)
+{
+    const Connection& c = *dp.get_connection();
+    const handler_allocator& rx = c.get_rx_allocator();
+    const handler_allocator& tx = c.get_tx_allocator();
+    s.handler_hits = rx.hits() + tx.hits();
+    s.handler_misses = rx.misses() + tx.misses();
+    s.handler_largest = std::max(rx.largest(), tx.largest());
+}
+
+void
+Openflow_manager::get_stats(std::vector<Datapath_stats>& stats)
+{
+    boost::lock_guard<boost::mutex> lock(dp_mutex);
+    stats.reserve(stats.size() + connected_dps.size() + connecting_dps.size());
+    BOOST_FOREACH(const Datapath_map::value_type& entry, connected_dps)
+    {
+        Datapath_stats s;
+        s.id = entry.first;
+        s.peer = peer_name(*entry.second);
+        s.stats = entry.second->get_stats().snapshot();
+        get_handler_stats(*entry.second, s);
+        stats.push_back(s);
+    }
+    BOOST_FOREACH(const boost::shared_ptr<Openflow_datapath>& dp,
+                  connecting_dps)
+    {
+        Datapath_stats s;
+        s.peer = peer_name(*dp);
+        s.stats = dp->get_stats().snapshot();
+        get_handler_stats(*dp, s);
+        stats.push_back(s);
+    }
+}
+
+std::string
+Openflow_manager::report_stats()
+{
+    std::vector<Datapath_stats> stats;
+    get_stats(stats);
+
+    timeval now;
+    gettimeofday(&now, 0);
+    const uint64_t now_us = uint64_t(now.tv_sec) * 1000000 + now.tv_usec;
+
+    std::string s = string_format("%-23s %-44s %12s %12s %10s %10s %10s %10s"
+                                  " %8s %10s %8s %10s %8s %7s\n",
+                                  "datapath", "peer", "tx bytes", "rx bytes",
+                                  "tx msgs", "rx msgs", "writes", "reads",
+                                  "partial", "txq max", "idle(s)",
+                                  "hdlr hits", "misses", "largest");
+    BOOST_FOREACH(const Datapath_stats& dp, stats)
+    {
+        const Connection_stats::Snapshot& c = dp.stats;
+        const double idle = c.last_activity && now_us > c.last_activity
+            ? (now_us - c.last_activity) / 1e6 : 0;
+        s += string_format("%-23s %-44s %12" PRIu64 " %12" PRIu64 " %10" PRIu64
+                           " %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+                           " %8" PRIu64 " %10" PRIu64 " %8.1f"
+                           " %10" PRIu64 " %8" PRIu64 " %7zu\n",
+                           dp.id.string().c_str(), dp.peer.c_str(),
+                           c.tx_bytes, c.rx_bytes, c.tx_msgs, c.rx_msgs,
+                           c.writes, c.reads, c.partial_writes,
+                           c.tx_queue_max, idle, dp.handler_hits,
+                           dp.handler_misses, dp.handler_largest);
+    }
+    return s;
+}
+
 Disposition
 Openflow_manager::handle_datapath_join(const Event& e)
 {
@@ -177,12 +273,10 @@ Openflow_manager::handle_datapath_leave(const Event& e)
 }
 
 Disposition
-Openflow_manager::handle_echo_request(const Event& e)
+Openflow_manager::handle_echo_request(const Openflow_echo_request_event& ere)
 {
-    auto ofe = assert_cast<const Openflow_event&>(e);
-    auto req = assert_cast<const v1::ofp_echo_request*>(ofe.msg);
-    v1::ofp_echo_reply rep(*req);
-    ofe.dp.send(&rep);
+    v1::ofp_echo_reply rep(ere.msg);
+    ere.dp.send(&rep);
     return STOP;
 }
 
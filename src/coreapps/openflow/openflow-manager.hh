@@ -20,12 +20,15 @@
 #define OPENFLOW_MANAGER_HH 1
 
 #include <set>
+#include <string>
+#include <vector>
 #include <boost/asio/streambuf.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/unordered_map.hpp>
 
 #include "component.hh"
+#include "connection.hh"
 #include <openflow/openflow-1.0.hh>
 #include "openflow-datapath.hh"
 #include "netinet++/datapathid.hh"
@@ -36,6 +39,7 @@ namespace openflow
 {
 
 class Openflow_datapath;
+template <typename Msg> class Openflow_msg_event;
 
 /* Openflow component */
 class Openflow_manager : public Component
@@ -44,6 +48,36 @@ public:
     Openflow_manager(const Component_context* ctxt);
     void configure();
 
+    /* Microseconds a message sent under a Cork may be held back before
+     * being written, or a negative value if messages are not corked */
+    long get_cork_max_delay() const
+    {
+        return cork_max_delay;
+    }
+
+    /* Connection statistics of a datapath */
+    struct Datapath_stats
+    {
+        /* Zero until the datapath has joined */
+        datapathid id;
+        std::string peer;
+        Connection_stats::Snapshot stats;
+        /* Handler memory of the connection, both directions together:
+         * allocations served from its slots and from the heap, and the
+         * largest one requested */
+        uint64_t handler_hits;
+        uint64_t handler_misses;
+        std::size_t handler_largest;
+    };
+
+    /* Append the statistics of every datapath, joined or still in the
+     * OpenFlow handshake, to 'stats' */
+    void get_stats(std::vector<Datapath_stats>& stats);
+
+    /* Render the statistics of every datapath as a table, as served by
+     * the statistics socket of the event dispatcher */
+    std::string report_stats();
+
 private:
     typedef boost::unordered_map<datapathid, boost::shared_ptr<Openflow_datapath> >
     Datapath_map;
@@ -53,6 +87,8 @@ private:
     Datapath_set connecting_dps;
     boost::mutex dp_mutex;
 
+    long cork_max_delay;
+
     void register_default_events();
     void register_default_handlers();
 
@@ -60,7 +96,8 @@ private:
     Disposition handle_new_connection(const Event&);
     Disposition handle_datapath_join(const Event&);
     Disposition handle_datapath_leave(const Event&);
-    Disposition handle_echo_request(const Event&);
+    Disposition handle_echo_request(
+        const Openflow_msg_event<v1::ofp_echo_request>&);
 };
 
 } // namespace openflow
@@ -0,0 +1,348 @@
+/* Copyright 2008 (C) Nicira, Inc.
+ *
+ * This file is part of NOX.
+ *
+ * NOX is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NOX is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NOX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef OPENFLOW_OF1_WRITER_HH
+#define OPENFLOW_OF1_WRITER_HH 1
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <openflow/openflow-1.0.hh>
+#include "wire-layout.hh"
+
+namespace vigil
+{
+namespace openflow
+{
+namespace v1
+{
+
+/* Writes one message straight into a send buffer, for the paths that
+ * would otherwise build a message object only to serialize it.
+ *
+ * Room for 'room' bytes, the expected size of the message, is prepared
+ * at the end of the buffer and the fields are written into it in wire
+ * order; the fixed fields are filled with the defaults of
+ * the matching message class, and may be set again until commit().
+ * commit() patches the length in the header, and the length of the
+ * actions where the message has one, then commits the bytes to the
+ * buffer.  Nothing else may be written to the buffer in the meantime.
+ *
+ * A message that does not fit in what is left of the buffer is not
+ * committed, and commit() returns 0, as Openflow_datapath::send() does. */
+class ofp_writer
+    : boost::noncopyable
+{
+public:
+    ofp_writer(boost::asio::streambuf& sb_, uint8_t type, std::size_t room,
+               uint32_t xid = 0)
+        : sb(sb_), base(0), capacity(0), used(0), full(false),
+          actions_begin(0), actions_end(0), actions_len_at(0)
+    {
+        reserve(room, 0);
+        put8(OFP_VERSION);
+        put8(type);
+        put16(0);
+        put32(xid ? xid : next_xid());
+    }
+
+    /* Bytes written so far */
+    std::size_t length() const
+    {
+        return used;
+    }
+
+    ofp_writer& put8(uint8_t value)
+    {
+        return put(value, 1);
+    }
+    ofp_writer& put16(uint16_t value)
+    {
+        return put(value, 2);
+    }
+    ofp_writer& put32(uint32_t value)
+    {
+        return put(value, 4);
+    }
+    ofp_writer& put64(uint64_t value)
+    {
+        return put(value, 8);
+    }
+    ofp_writer& put_bytes(const void* data, std::size_t size)
+    {
+        if (uint8_t* p = room(size))
+        {
+            memcpy(p, data, size);
+        }
+        return *this;
+    }
+    ofp_writer& put_zeros(std::size_t size)
+    {
+        if (uint8_t* p = room(size))
+        {
+            memset(p, 0, size);
+        }
+        return *this;
+    }
+    ofp_writer& put_match(const ofp_match& match)
+    {
+        const Wire_layout& layout = Wire_layout::of<ofp_match>();
+        if (uint8_t* p = room(layout.size()))
+        {
+            layout.encode(&match, p);
+        }
+        return *this;
+    }
+
+    /* Append an OFPAT_OUTPUT action */
+    ofp_writer& action_output(uint16_t port, uint16_t max_len = OFP_MAX_LEN)
+    {
+        put16(ofp_action::OFPAT_OUTPUT);
+        put16(OFP_ACTION_OUTPUT_BYTES);
+        put16(port);
+        put16(max_len);
+        actions_end = used;
+        return *this;
+    }
+
+    /* Finish the message, returning its length, or 0 if it did not fit */
+    std::size_t commit()
+    {
+        if (full)
+        {
+            return 0;
+        }
+        set(2, used, 2);
+        if (actions_len_at)
+        {
+            set(actions_len_at, actions_end - actions_begin, 2);
+        }
+        sb.commit(used);
+        full = true;
+        return used;
+    }
+
+protected:
+    /* Overwrite the field of 'size' bytes at 'offset' from the start of
+     * the message */
+    void set(std::size_t offset, uint64_t value, std::size_t size)
+    {
+        if (!full)
+        {
+            store(base + offset, value, size);
+        }
+    }
+
+    /* Where the actions of the message start, and where the length of
+     * the actions goes if the message has one */
+    void actions_at(std::size_t length_offset = 0)
+    {
+        actions_begin = actions_end = used;
+        actions_len_at = length_offset;
+    }
+
+    /* Room left for actions by the typed writers */
+    static const std::size_t ACTIONS_ROOM = 8 * OFP_ACTION_OUTPUT_BYTES;
+
+private:
+    boost::asio::streambuf& sb;
+    uint8_t* base;
+    std::size_t capacity;
+    std::size_t used;
+    // Set once the message has outgrown the buffer, or was committed
+    bool full;
+    std::size_t actions_begin;
+    std::size_t actions_end;
+    std::size_t actions_len_at;
+
+    static void store(uint8_t* p, uint64_t value, std::size_t size)
+    {
+        for (std::size_t i = size; i-- > 0; value >>= 8)
+        {
+            p[i] = uint8_t(value);
+        }
+    }
+
+    ofp_writer& put(uint64_t value, std::size_t size)
+    {
+        if (uint8_t* p = room(size))
+        {
+            store(p, value, size);
+        }
+        return *this;
+    }
+
+    /* The next 'size' bytes of the message, or null if they do not fit */
+    uint8_t* room(std::size_t size)
+    {
+        if (full)
+        {
+            return 0;
+        }
+        if (used + size > capacity
+            && !reserve(std::max(2 * capacity, used + size), used + size))
+        {
+            full = true;
+            return 0;
+        }
+        uint8_t* p = base + used;
+        used += size;
+        return p;
+    }
+
+    /* Prepare room for 'wanted' bytes of message, or for what is left of
+     * the buffer if less, returning false if that is under 'needed'.
+     * Bytes prepared but not committed do not survive a new prepare(),
+     * so those already written are carried over: a message outgrowing
+     * the room it was started with costs a copy of itself. */
+    bool reserve(std::size_t wanted, std::size_t needed)
+    {
+        const std::size_t limit =
+            std::min<std::size_t>(sb.max_size() - sb.size(), UINT16_MAX);
+        if (needed > limit)
+        {
+            return false;
+        }
+        std::vector<uint8_t> written(base, base + used);
+        capacity = std::min(wanted, limit);
+        base = boost::asio::buffer_cast<uint8_t*>(sb.prepare(capacity));
+        std::copy(written.begin(), written.end(), base);
+        return true;
+    }
+};
+
+/* OFPT_FLOW_MOD: the match and fixed fields, then the actions */
+class ofp_flow_mod_writer : public ofp_writer
+{
+public:
+    ofp_flow_mod_writer(boost::asio::streambuf& sb, const ofp_match& match,
+                        uint16_t command = ofp_flow_mod::OFPFC_ADD,
+                        uint32_t xid = 0)
+        : ofp_writer(sb, ofp_msg::OFPT_FLOW_MOD,
+                     OFP_FLOW_MOD_BYTES + ACTIONS_ROOM, xid)
+    {
+        put_match(match);
+        put64(0);                               // cookie
+        put16(command);
+        put16(0);                               // idle_timeout
+        put16(0);                               // hard_timeout
+        put16(OFP_DEFAULT_PRIORITY);
+        put32(UINT32_MAX);                      // buffer_id
+        put16(ofp_phy_port::OFPP_NONE);         // out_port
+        put16(SEND_FLOW_REMOVED ? ofp_flow_mod::OFPFF_SEND_FLOW_REM : 0);
+        actions_at();
+    }
+
+    ofp_flow_mod_writer& cookie(uint64_t v)
+    {
+        set(48, v, 8);
+        return *this;
+    }
+    ofp_flow_mod_writer& command(uint16_t v)
+    {
+        set(56, v, 2);
+        return *this;
+    }
+    ofp_flow_mod_writer& idle_timeout(uint16_t v)
+    {
+        set(58, v, 2);
+        return *this;
+    }
+    ofp_flow_mod_writer& hard_timeout(uint16_t v)
+    {
+        set(60, v, 2);
+        return *this;
+    }
+    ofp_flow_mod_writer& priority(uint16_t v)
+    {
+        set(62, v, 2);
+        return *this;
+    }
+    ofp_flow_mod_writer& buffer_id(uint32_t v)
+    {
+        set(64, v, 4);
+        return *this;
+    }
+    ofp_flow_mod_writer& out_port(uint16_t v)
+    {
+        set(68, v, 2);
+        return *this;
+    }
+    ofp_flow_mod_writer& flags(uint16_t v)
+    {
+        set(70, v, 2);
+        return *this;
+    }
+    ofp_flow_mod_writer& action_output(uint16_t port,
+                                       uint16_t max_len = OFP_MAX_LEN)
+    {
+        ofp_writer::action_output(port, max_len);
+        return *this;
+    }
+};
+
+/* OFPT_PACKET_OUT: the fixed fields, the actions, then the packet if it
+ * is not buffered by the datapath, of 'packet_bytes' */
+class ofp_packet_out_writer : public ofp_writer
+{
+public:
+    ofp_packet_out_writer(boost::asio::streambuf& sb,
+                          std::size_t packet_bytes = 0, uint32_t xid = 0)
+        : ofp_writer(sb, ofp_msg::OFPT_PACKET_OUT,
+                     OFP_PACKET_OUT_BYTES + ACTIONS_ROOM + packet_bytes, xid)
+    {
+        put32(UINT32_MAX);                      // buffer_id
+        put16(ofp_phy_port::OFPP_NONE);         // in_port
+        put16(0);                               // actions_len
+        actions_at(14);
+    }
+
+    ofp_packet_out_writer& buffer_id(uint32_t v)
+    {
+        set(8, v, 4);
+        return *this;
+    }
+    ofp_packet_out_writer& in_port(uint16_t v)
+    {
+        set(12, v, 2);
+        return *this;
+    }
+    ofp_packet_out_writer& action_output(uint16_t port,
+                                         uint16_t max_len = OFP_MAX_LEN)
+    {
+        ofp_writer::action_output(port, max_len);
+        return *this;
+    }
+    /* Append the packet, after the last action */
+    ofp_packet_out_writer& packet(const boost::asio::const_buffer& packet)
+    {
+        put_bytes(boost::asio::buffer_cast<const uint8_t*>(packet),
+                  boost::asio::buffer_size(packet));
+        return *this;
+    }
+};
+
+} // namespace v1
+} // namespace openflow
+} // namespace vigil
+
+#endif /* openflow-writer-1.0.hh */
@@ -28,6 +28,7 @@
 #include <tbb/concurrent_hash_map.h>
 
 #include "assert.hh"
+#include "batch-event.hh"
 #include "component.hh"
 #include "vlog.hh"
 
@@ -61,8 +62,8 @@ public:
 
     void install() {}
 
-    Disposition handle_datapath_join(const Event&);
-    Disposition handle_datapath_leave(const Event&);
+    Disposition handle_datapath_join(const Openflow_datapath_join_event&);
+    Disposition handle_datapath_leave(const Openflow_datapath_leave_event&);
     Disposition handle_packet_in(const Event&);
 
 private:
@@ -83,6 +84,9 @@ private:
     /* Set up a flow when we know the destination of a packet?  This should
      * ordinarily be true; it is only usefully false for debugging purposes. */
     bool setup_flows;
+
+    void handle_packet_in(Openflow_datapath&, mac_table&,
+                          const v1::ofp_packet_in&);
 };
 
 inline void
@@ -101,33 +105,53 @@ Switch::configure()
             }
         }
     }
-    register_handler("Openflow_datapath_join_event", (boost::bind(&Switch::handle_datapath_join, this, _1)));
-    register_handler("Openflow_datapath_leave_event", (boost::bind(&Switch::handle_datapath_leave, this, _1)));
-    register_handler("ofp_packet_in", (boost::bind(&Switch::handle_packet_in, this, _1)));
+    register_handler<Openflow_datapath_join_event>(&Switch::handle_datapath_join);
+    register_handler<Openflow_datapath_leave_event>(&Switch::handle_datapath_leave);
+    register_batch_handler("ofp_packet_in", (boost::bind(&Switch::handle_packet_in, this, _1)));
 }
 
 inline Disposition
-Switch::handle_datapath_join(const Event& e)
+Switch::handle_datapath_join(const Openflow_datapath_join_event& dpje)
 {
-    auto& dpje = assert_cast<const Openflow_datapath_join_event&>(e);
     mac_tables.insert(std::make_pair(dpje.dp->id(), mac_table()));
     return CONTINUE;
 }
 
 inline Disposition
-Switch::handle_datapath_leave(const Event& e)
+Switch::handle_datapath_leave(const Openflow_datapath_leave_event& dple)
 {
-    auto& dple = assert_cast<const Openflow_datapath_leave_event&>(e);
     mac_tables.erase(dple.dp->id());
     return CONTINUE;
 }
 
+/* Handle a burst of packet-ins.  A batch always comes from a single
+ * datapath, so its MAC table is looked up and locked only once. */
 inline Disposition
 Switch::handle_packet_in(const Event& e)
 {
-    auto ofe = assert_cast<const Openflow_event&>(e);
-    auto& dp = ofe.dp;
-    auto pi = *(assert_cast<const v1::ofp_packet_in*>(ofe.msg));
+    auto& batch = assert_cast<const Batch_event&>(e);
+    auto& dp = assert_cast<const Openflow_event&>(batch[0]).dp;
+
+    mac_table_map::accessor accessor;
+    if (!mac_tables.find(accessor, dp.id()))
+    {
+        return CONTINUE;
+    }
+    auto& mac_table = accessor->second;
+
+    BOOST_FOREACH(const Event* event, batch)
+    {
+        auto& ofe = assert_cast<const Openflow_event&>(*event);
+        handle_packet_in(dp, mac_table,
+                         *assert_cast<const v1::ofp_packet_in*>(ofe.msg));
+    }
+    return CONTINUE;
+}
+
+inline void
+Switch::handle_packet_in(Openflow_datapath& dp, mac_table& mac_table,
+                         const v1::ofp_packet_in& pi)
+{
     int out_port = -1;        // Flood by default
 
     v1::ofp_match flow;
@@ -136,13 +160,9 @@ Switch::handle_packet_in(const Event& e)
     // Drop all LLDP packets
     if (flow.dl_type() == ethernet::LLDP)
     {
-        return CONTINUE;
+        return;
     }
 
-    mac_table_map::accessor accessor;
-    mac_tables.find(accessor, dp.id());
-    auto& mac_table = accessor->second;
-
     // Learn the source MAC
     if (!flow.dl_src().is_multicast())
     {
@@ -159,13 +179,12 @@ Switch::handle_packet_in(const Event& e)
     // Set up a flow if the output port is known
     if (setup_flows && out_port != -1)
     {
-        auto fm = v1::ofp_flow_mod().match(flow).buffer_id(pi.buffer_id())
-                   .cookie(0).command(v1::ofp_flow_mod::OFPFC_ADD).idle_timeout(5)
-                   .hard_timeout(v1::OFP_FLOW_PERMANENT)
-                   .priority(v1::OFP_DEFAULT_PRIORITY);
-        auto ao = v1::ofp_action_output().port(out_port);
-        fm.add_action(&ao);
-        dp.send(&fm);
+        Openflow_datapath::Send_lock lock(dp);
+        v1::ofp_flow_mod_writer fm(lock.buffer(), flow);
+        fm.buffer_id(pi.buffer_id()).idle_timeout(5)
+          .hard_timeout(v1::OFP_FLOW_PERMANENT)
+          .action_output(out_port);
+        lock.send(fm);
     }
 
     // Send out packet if necessary
@@ -174,29 +193,29 @@ Switch::handle_packet_in(const Event& e)
         if (out_port == -1)
             out_port = v1::ofp_phy_port::OFPP_FLOOD;
 
-        auto po = v1::ofp_packet_out().in_port(pi.in_port());
-        auto ao = v1::ofp_action_output().port(out_port);
-        po.add_action(&ao);
-
-        if (pi.buffer_id() == UINT32_MAX)
+        if (pi.buffer_id() == UINT32_MAX
+            && pi.total_len() != boost::asio::buffer_size(pi.packet()))
         {
-            if (pi.total_len() != boost::asio::buffer_size(pi.packet()))
-            {
-                /* Control path didn't buffer the packet and didn't send us
-                 * the whole thing--what gives? */
-                VLOG_DBG(lg, "total_len=%u data_len=%zu\n",
-                         pi.total_len(), boost::asio::buffer_size(pi.packet()));
-                return CONTINUE;
-            }
-            po.packet(pi.packet());
+            /* Control path didn't buffer the packet and didn't send us
+             * the whole thing--what gives? */
+            VLOG_DBG(lg, "total_len=%u data_len=%zu\n",
+                     pi.total_len(), boost::asio::buffer_size(pi.packet()));
+            return;
         }
-        else
+
+        const bool unbuffered = pi.buffer_id() == UINT32_MAX;
+        Openflow_datapath::Send_lock lock(dp);
+        v1::ofp_packet_out_writer po(
+            lock.buffer(),
+            unbuffered ? boost::asio::buffer_size(pi.packet()) : 0);
+        po.buffer_id(pi.buffer_id()).in_port(pi.in_port())
+          .action_output(out_port);
+        if (unbuffered)
         {
-            po.buffer_id(pi.buffer_id());
+            po.packet(pi.packet());
         }
-        dp.send(&po);
+        lock.send(po);
     }
-    return CONTINUE;
 }
 
 REGISTER_COMPONENT(Simple_component_factory<Switch>, Switch);
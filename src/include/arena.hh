@@ -0,0 +1,112 @@
+/* Copyright 2008 (C) Nicira, Inc.
+ *
+ * This file is part of NOX.
+ *
+ * NOX is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NOX is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NOX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ARENA_HH
+#define ARENA_HH 1
+
+#include <cstddef>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+namespace vigil
+{
+
+/* Bump allocator for objects that are released all at once.
+ *
+ * Memory is carved out of blocks in order and only ever given back by
+ * reset().  If the allocations since the last reset did not fit in one
+ * block, reset() replaces the blocks with a single one large enough for
+ * all of them, so a steady workload settles on one block and stops
+ * touching the heap.
+ *
+ * Destructors are never run: only objects that own nothing belong here.
+ * An arena is not thread-safe. */
+class Arena
+    : boost::noncopyable
+{
+public:
+    /* Alignment of every allocation, enough for any member type */
+    static const std::size_t ALIGNMENT = 16;
+
+    explicit Arena(std::size_t block_size_ = 4096)
+        : block_size(block_size_), used(0), total(0) {}
+
+    ~Arena()
+    {
+        release();
+    }
+
+    void* allocate(std::size_t size)
+    {
+        size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        if (blocks.empty() || blocks.back().size - used < size)
+        {
+            grow(size);
+        }
+        char* p = blocks.back().data + used;
+        used += size;
+        total += size;
+        return p;
+    }
+
+    /* Make all memory handed out so far available again. */
+    void reset()
+    {
+        if (blocks.size() > 1)
+        {
+            release();
+            block_size = total;
+        }
+        used = 0;
+        total = 0;
+    }
+
+private:
+    struct Block
+    {
+        char* data;
+        std::size_t size;
+    };
+
+    std::vector<Block> blocks;
+    std::size_t block_size;
+    std::size_t used;
+    std::size_t total;
+
+    void grow(std::size_t size)
+    {
+        Block block;
+        block.size = size > block_size ? size : block_size;
+        block.data = new char[block.size];
+        blocks.push_back(block);
+        used = 0;
+    }
+
+    void release()
+    {
+        for (std::vector<Block>::iterator i = blocks.begin();
+             i != blocks.end(); ++i)
+        {
+            delete[] i->data;
+        }
+        blocks.clear();
+    }
+};
+
+} // namespace vigil
+
+#endif /* arena.hh */
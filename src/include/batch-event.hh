@@ -0,0 +1,74 @@
+/* Copyright 2008 (C) Nicira, Inc.
+ *
+ * This file is part of NOX.
+ *
+ * NOX is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NOX is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NOX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef BATCH_EVENT_HH
+#define BATCH_EVENT_HH 1
+
+#include <cstddef>
+
+#include "event.hh"
+
+namespace vigil
+{
+
+/** \ingroup noxevents
+ *
+ * A burst of events of a single type, handed at once to the handlers
+ * registered through register_batch_handler().  The batch carries the type
+ * and name of its events.
+ *
+ * Neither the batch nor the events it points to may be retained after the
+ * handler returns.
+ */
+
+class Batch_event
+    : public Event
+{
+public:
+    typedef const Event* const* const_iterator;
+
+    Batch_event(Event_type type_, const_iterator begin_, const_iterator end_)
+        : Event(type_), first(begin_), last(end_) { }
+
+    const_iterator begin() const
+    {
+        return first;
+    }
+
+    const_iterator end() const
+    {
+        return last;
+    }
+
+    std::size_t size() const
+    {
+        return last - first;
+    }
+
+    const Event& operator[](std::size_t i) const
+    {
+        return *first[i];
+    }
+
+private:
+    const_iterator first;
+    const_iterator last;
+};
+
+} // namespace vigil
+
+#endif /* batch-event.hh */
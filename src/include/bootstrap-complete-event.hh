@@ -27,7 +27,7 @@ struct Bootstrap_complete_event
         : public Event
 {
     Bootstrap_complete_event()
-        : Event(static_get_name()) { }
+        : Event(get_event_type<Bootstrap_complete_event>()) { }
 
     static const Event_name static_get_name()
     {
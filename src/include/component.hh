@@ -36,12 +36,14 @@
 #include <boost/shared_array.hpp>
 
 #include "event.hh"
+#include "typed-event-handler.hh"
 #include "hash_map.hh"
 #include "hash_set.hh"
 
 namespace vigil
 {
 
+class Batch_event;
 class Event_dispatcher;
 class Dependency;
 class Kernel;
@@ -254,16 +256,81 @@ public:
     /* Register an event handler */
     void register_handler(const Event_name&, const Event_handler&) const;
 
+    /* Register a typed event handler: a member function of the component
+     * taking the event as 'Ev' rather than as a generic Event, e.g.
+     *
+     *   register_handler<Openflow_packet_in_event>(&Switch::handle_packet_in);
+     *
+     * The handler is called without boost::function, and gets the event
+     * without casts or copies.  See typed-event-handler.hh. */
+    template <typename Ev, typename T>
+    inline
+    void register_handler(Disposition (T::*h)(const Ev&)) const
+    {
+        register_handler(Ev::static_get_name(),
+                         Typed_event_handler(self<T>(), h));
+    }
+
+    template <typename Ev, typename T>
+    inline
+    void register_handler(void (T::*h)(const Ev&)) const
+    {
+        register_handler(Ev::static_get_name(),
+                         Typed_event_handler(self<T>(), h));
+    }
+
+    /* Register a typed event handler */
+    void register_handler(const Event_name&, const Typed_event_handler&) const;
+
+    /* Register a handler for bursts of events, see batch-event.hh */
+    template <typename T>
+    inline
+    void register_batch_handler(const Event_handler& h) const
+    {
+        register_batch_handler(T::static_get_name(), h);
+    }
+
+    /* Register a handler for bursts of events, see batch-event.hh */
+    void register_batch_handler(const Event_name&, const Event_handler&) const;
+
+    /* Unregister the handlers of this component for an event.  See
+     * Event_dispatcher::unregister_handler(). */
+    void unregister_handler(const Event_name&) const;
+
     /* Dispatch an event directly */
     void dispatch(const Event&) const;
 
+    /* Dispatch a burst of events of the same type directly */
+    void dispatch_batch(const Batch_event&) const;
+
     /* Post an event */
     void post(const Event&) const;
 
+    /* Post an event, handing over its ownership */
+    void post(Event_ptr) const;
+
+    /* True while posted events should be held off, see
+     * Event_dispatcher::is_paused() */
+    bool is_paused() const;
+
+    /* Call 'resume' once posted events are accepted again */
+    void when_ready(const boost::function<void()>& resume) const;
+
+    /* True if events of 'type' are scheduled in the highest priority
+     * class, see Event_dispatcher::get_priority_class() */
+    bool is_high_priority(Event_type) const;
+
 protected:
     /* Component_context to access the container */
     const Component_context* ctxt;
 
+    /* This component as its concrete class 'T' */
+    template <typename T>
+    T* self() const
+    {
+        return static_cast<T*>(const_cast<Component*>(this));
+    }
+
     /* A handle to event_dispatcher */
     Event_dispatcher* event_dispatcher;
 };
@@ -19,13 +19,17 @@
 #define CONNECTION_MANAGER_HH 1
 
 #include <inttypes.h>
+#include <atomic>
 #include <memory>
 #include <string>
 #include <vector>
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
 #include <boost/function.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/timer.hpp>
 #include <boost/unordered_map.hpp>
 #include <boost/unordered_set.hpp>
@@ -39,8 +43,10 @@ namespace vigil
 
 typedef boost::asio::ip::tcp::socket tcp_socket;
 typedef boost::asio::ssl::stream<tcp_socket> ssl_socket;
+typedef boost::asio::local::stream_protocol::socket unix_socket;
 
 class Connection;
+class Epoll_reactor;
 
 /* Connection manager component */
 class Connection_manager
@@ -51,11 +57,25 @@ public:
     static Component* instantiate(const Component_context*,
                                   const std::list<std::string>& interfaces);
 
+    ~Connection_manager();
+
     void configure();
     void install();
 
+    /* Accepted SSL connections waiting for, or in, their handshake */
+    std::size_t get_handshake_queue_depth() const
+    {
+        return handshake_queue_depth.load(std::memory_order_relaxed);
+    }
+
+    /* SSL connections refused because the handshake queue was full */
+    uint64_t get_handshakes_refused() const
+    {
+        return handshakes_refused.load(std::memory_order_relaxed);
+    }
+
 private:
-    enum Conn_t { TCP, SSL, PTCP, PSSL, UNKNOWN };
+    enum Conn_t { TCP, SSL, PTCP, PSSL, PTCP_EPOLL, UNIX, PUNIX, UNKNOWN };
 
     typedef boost::function<void()> Listen_callback;
     //typedef std::string Protocol_name;
@@ -68,6 +88,106 @@ private:
     // List of interfaces we are listening on
     std::list<std::string> interfaces;
 
+    // Reactors of the ptcp-epoll interfaces, one per thread, and the one
+    // the next connection goes to
+    boost::ptr_vector<Epoll_reactor> reactors;
+    std::atomic<std::size_t> next_reactor;
+
+    // Acceptors per listening interface, 0 for one per dispatcher thread;
+    // more than one share the port through SO_REUSEPORT
+    std::size_t n_acceptors;
+    // Listen backlog
+    int backlog;
+    // Connections taken per accept wakeup
+    std::size_t accept_batch;
+    // Disable Nagle's algorithm on TCP connections.  Replies are already
+    // batched by the OpenFlow layer (see Cork), so this is only worth
+    // turning off to let the kernel coalesce what is sent outside of one.
+    bool tcp_nodelay;
+
+    // SSL context of a pssl interface.  It is loaded once and shared by
+    // every connection accepted on the interface, so that they can resume
+    // each other's sessions; a reload replaces it as a whole.
+    struct Ssl_server
+    {
+        std::string key;
+        std::string cert;
+        std::string cafile;
+
+        boost::mutex mutex;
+        boost::shared_ptr<boost::asio::ssl::context> context;
+    };
+    std::vector<boost::shared_ptr<Ssl_server> > ssl_servers;
+
+    // Server-side session cache and tickets
+    long ssl_session_cache_size;
+    long ssl_session_timeout;
+    bool ssl_session_tickets;
+    // Reload the SSL files on SIGHUP
+    bool ssl_reload;
+
+    // An active (tcp: or ssl:) interface.  Whenever its connection fails
+    // or drops, it is dialed again after a backoff that doubles with each
+    // failed attempt or short-lived session, from 'min_backoff' up to
+    // 'max_backoff', of which a random part is waited so that controllers
+    // restarted together do not reconnect in lockstep.  Only one attempt or timer is pending at a
+    // time, so the state needs no lock.
+    struct Peer
+    {
+        Peer(boost::asio::io_service& io) : timer(io) { }
+
+        Conn_t type;
+        std::string name;
+        boost::asio::ip::tcp::endpoint endpoint;
+        boost::asio::local::stream_protocol::endpoint path;
+        boost::shared_ptr<boost::asio::ssl::context> ssl_context;
+
+        // Failed attempts, and dropped sessions that were not up for long
+        unsigned failures;
+        unsigned seed;
+        // Start of the current session, if any
+        boost::posix_time::ptime connected_at;
+        boost::asio::deadline_timer timer;
+    };
+    std::vector<boost::shared_ptr<Peer> > peers;
+
+    // Redial active interfaces, in milliseconds between attempts
+    bool reconnect_enabled;
+    long min_backoff;
+    long max_backoff;
+
+    // Paths of the punix sockets, removed on shutdown
+    std::vector<std::string> unix_paths;
+
+    // Server-side TLS handshakes run asynchronously, with their handlers,
+    // and so their public key operations, on a pool of their own rather
+    // than on the event loop; connections move to the event loop once
+    // their handshake is done.  No pool with 0 threads.
+    std::size_t n_handshake_threads;
+    // Handshakes in flight before new connections are refused
+    std::size_t handshake_queue_limit;
+    // Seconds a peer may take to complete its handshake, 0 for no limit
+    long handshake_timeout;
+    // A handshake in flight.  Its handlers and those of its deadline go
+    // through 'strand', so whichever of the two ends first sets 'state'
+    // and the other then leaves the socket alone.
+    struct Handshake
+    {
+        enum State { PENDING, DONE, EXPIRED };
+
+        Handshake(boost::asio::io_service& io)
+            : strand(io), timer(io), state(PENDING) { }
+
+        boost::asio::io_service::strand strand;
+        boost::asio::deadline_timer timer;
+        State state;
+    };
+    boost::asio::io_service handshake_io;
+    boost::scoped_ptr<boost::asio::io_service::work> handshake_work;
+    boost::thread_group handshake_threads;
+    std::atomic<std::size_t> handshake_queue_depth;
+    std::atomic<uint64_t> handshakes_refused;
+
     Connection_manager(const Component_context*,
                        const std::list<std::string>& interfaces);
 
@@ -83,6 +203,12 @@ private:
     void handle_connect(boost::shared_ptr<Async_stream>,
                         Listen_callback,
                         const boost::system::error_code&);
+    template <typename Async_stream>
+    boost::shared_ptr<Connection>
+    make_connection(boost::shared_ptr<Async_stream>);
+    template <typename Async_stream>
+    void serve(boost::shared_ptr<Async_stream>);
+    void serve_epoll(boost::shared_ptr<tcp_socket>);
 
     void handle_handshake(boost::asio::ssl::stream_base::handshake_type,
                           boost::shared_ptr<ssl_socket>,
@@ -92,12 +218,41 @@ private:
                  const std::string& key,
                  const std::string& cert,
                  const std::string& cafile);
+    void connect(boost::shared_ptr<Peer>);
+    void handle_client_connect(boost::shared_ptr<Peer>,
+                               boost::shared_ptr<ssl_socket>,
+                               const boost::system::error_code&);
+    template <typename Async_stream>
+    void handle_connected(boost::shared_ptr<Peer>,
+                          boost::shared_ptr<Async_stream>,
+                          const boost::system::error_code&);
+    void reconnect(boost::shared_ptr<Peer>);
+    void handle_backoff(boost::shared_ptr<Peer>,
+                        const boost::system::error_code&);
 
     void listen(boost::shared_ptr<boost::asio::ip::tcp::acceptor>);
     void listen(boost::shared_ptr<boost::asio::ip::tcp::acceptor>,
-                const std::string& key,
-                const std::string& cert,
-                const std::string& cafile);
+                boost::shared_ptr<Ssl_server>);
+    boost::shared_ptr<boost::asio::ssl::context>
+    load_ssl_context(const Ssl_server&);
+    Disposition handle_reload(const Event&);
+    void handle_accept_ssl(boost::shared_ptr<ssl_socket>, Listen_callback,
+                           const boost::system::error_code&);
+    void handshake(boost::shared_ptr<Handshake>,
+                   boost::shared_ptr<ssl_socket>);
+    void handle_server_handshake(boost::shared_ptr<Handshake>,
+                                 boost::shared_ptr<ssl_socket>,
+                                 const boost::system::error_code&);
+    void handle_handshake_deadline(boost::shared_ptr<Handshake>,
+                                   boost::shared_ptr<ssl_socket>,
+                                   const boost::system::error_code&);
+    void accept_unix(boost::shared_ptr<boost::asio::local::stream_protocol::acceptor>);
+    void listen_unix(const std::string& path);
+    void listen_epoll(boost::shared_ptr<boost::asio::ip::tcp::acceptor>);
+    void handle_accept_epoll(boost::shared_ptr<tcp_socket>, Listen_callback,
+                             const boost::system::error_code&);
+    void accept_pending(boost::shared_ptr<boost::asio::ip::tcp::acceptor>,
+                        Conn_t type);
     void listen(Conn_t type, const std::string& bind_ip, const uint16_t& port,
                 const std::string& key,
                 const std::string& cert,
@@ -18,7 +18,10 @@
 #ifndef CONNECTION_HH
 #define CONNECTION_HH 1
 
+#include <stdint.h>
+#include <atomic>
 #include <string>
+#include <vector>
 #include <boost/aligned_storage.hpp>
 #include <boost/asio.hpp>
 #include <boost/enable_shared_from_this.hpp>
@@ -30,46 +33,186 @@ namespace vigil
 {
 
 // Class to manage the memory to be used for handler-based custom allocation.
-// It contains a single block of memory which may be returned for allocation
-// requests. If the memory is in use when an allocation request is made, the
-// allocator delegates allocation to the global heap.
+// It contains N_SLOTS blocks of memory, enough for every operation a
+// connection has in flight at once: a read, a write, and those an SSL
+// handshake or a strand adds on top.  Requests too large for a block, or
+// made while all the blocks are in use, are delegated to the global heap.
+// Blocks are claimed and returned without locking, since a handler may be
+// allocated on one thread and freed on another.
+//
+// SLOT_SIZE is that of the single block this allocator used to have.  The
+// largest handlers measured, those of SSL writes, take about a third of
+// it, but their size depends on the Boost release; the hit, miss and
+// largest request counters, in the "datapaths" statistics, tell whether
+// it covers the handlers in use.
 class handler_allocator
     : private boost::noncopyable
 {
 public:
+    static const std::size_t N_SLOTS = 4;
+    static const std::size_t SLOT_SIZE = 1024;
+
     handler_allocator()
+        : free_slots_((1u << N_SLOTS) - 1), hits_(0), misses_(0), largest_(0)
     {
-        in_use_ = false;
     }
 
     void* allocate(std::size_t size)
     {
-        if (!in_use_ && size < storage_.size)
+        if (size > largest_.load(std::memory_order_relaxed))
         {
-            in_use_ = true;
-            return storage_.address();
+            largest_.store(size, std::memory_order_relaxed);
         }
+
+        if (size <= SLOT_SIZE)
+        {
+            unsigned slots = free_slots_.load(std::memory_order_relaxed);
+            while (slots)
+            {
+                const unsigned slot = __builtin_ctz(slots);
+                if (free_slots_.compare_exchange_weak(
+                        slots, slots & ~(1u << slot),
+                        std::memory_order_acquire))
+                {
+                    hits_.fetch_add(1, std::memory_order_relaxed);
+                    return storage_[slot].address();
+                }
+            }
+        }
+        misses_.fetch_add(1, std::memory_order_relaxed);
         return ::operator new(size);
     }
 
     void deallocate(void* pointer)
     {
-        if (pointer == storage_.address())
+        const char* p = static_cast<const char*>(pointer);
+        const char* base = static_cast<const char*>(storage_[0].address());
+        if (p >= base && p < base + sizeof storage_)
         {
-            in_use_ = false;
+            const unsigned slot = (p - base) / sizeof storage_[0];
+            free_slots_.fetch_or(1u << slot, std::memory_order_release);
             return;
         }
         ::operator delete(pointer);
     }
 
-private:
-    std::size_t count;
+    // Allocations served from the blocks, and from the heap
+    uint64_t hits() const
+    {
+        return hits_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t misses() const
+    {
+        return misses_.load(std::memory_order_relaxed);
+    }
 
+    // Largest allocation requested
+    std::size_t largest() const
+    {
+        return largest_.load(std::memory_order_relaxed);
+    }
+
+private:
     // Storage space used for handler-based custom memory allocation.
-    boost::aligned_storage<1024> storage_;
+    boost::aligned_storage<SLOT_SIZE> storage_[N_SLOTS];
 
-    // Whether the handler-based custom allocation storage has been used.
-    bool in_use_;
+    // Bitmap of the blocks not in use.
+    std::atomic<unsigned> free_slots_;
+
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+    std::atomic<std::size_t> largest_;
+};
+
+// Counters of a connection.  They are updated without locking, by the
+// connection and by the protocol running over it, and may be read from any
+// thread at any time; a snapshot is not atomic as a whole.
+class Connection_stats
+    : private boost::noncopyable
+{
+public:
+    struct Snapshot
+    {
+        uint64_t tx_bytes;
+        uint64_t rx_bytes;
+        uint64_t tx_msgs;
+        uint64_t rx_msgs;
+        // Reads and writes issued on the socket, and the writes that took
+        // less than they were given
+        uint64_t reads;
+        uint64_t writes;
+        uint64_t partial_writes;
+        // Most bytes ever waiting to be sent
+        uint64_t tx_queue_max;
+        // Time of the last read or write, in microseconds since the epoch,
+        // or 0 if none
+        uint64_t last_activity;
+    };
+
+    Connection_stats();
+
+    // A read returning 'bytes' bytes
+    void read(size_t bytes)
+    {
+        add(rx_bytes_, bytes);
+        add(reads_, 1);
+        touch();
+    }
+
+    // A write taking 'bytes' of the 'requested' bytes
+    void wrote(size_t bytes, size_t requested)
+    {
+        add(tx_bytes_, bytes);
+        add(writes_, 1);
+        if (bytes < requested)
+        {
+            add(partial_writes_, 1);
+        }
+        touch();
+    }
+
+    void received_msg()
+    {
+        add(rx_msgs_, 1);
+    }
+
+    void sent_msg()
+    {
+        add(tx_msgs_, 1);
+    }
+
+    // 'bytes' bytes are now waiting to be sent
+    void queued(size_t bytes)
+    {
+        if (bytes > tx_queue_max_.load(std::memory_order_relaxed))
+        {
+            tx_queue_max_.store(bytes, std::memory_order_relaxed);
+        }
+    }
+
+    Snapshot snapshot() const;
+
+private:
+    // Every counter has a single writer at a time, so a plain load and
+    // store does instead of a locked read-modify-write
+    static void add(std::atomic<uint64_t>& counter, uint64_t n)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n,
+                      std::memory_order_relaxed);
+    }
+
+    void touch();
+
+    std::atomic<uint64_t> tx_bytes_;
+    std::atomic<uint64_t> rx_bytes_;
+    std::atomic<uint64_t> tx_msgs_;
+    std::atomic<uint64_t> rx_msgs_;
+    std::atomic<uint64_t> reads_;
+    std::atomic<uint64_t> writes_;
+    std::atomic<uint64_t> partial_writes_;
+    std::atomic<uint64_t> tx_queue_max_;
+    std::atomic<uint64_t> last_activity_;
 };
 
 /* Abstract class for a connection */
@@ -81,22 +224,69 @@ public:
     typedef boost::function<void()> Close_callback;
     typedef boost::function<void(const size_t&)> Recv_callback;
     typedef boost::function<void(const size_t&)> Send_callback;
+    typedef std::vector<boost::asio::const_buffer> Const_buffers;
 
     Connection();
     virtual ~Connection() {}
 
     virtual void register_cb(Close_callback&, Recv_callback&, Send_callback&) = 0;
     virtual void close(const boost::system::error_code&);
+
+    /* Call 'hook' after the close callback, the first time the connection
+     * is closed.  For whoever opened the connection, since the close
+     * callback belongs to the protocol running over it. */
+    void set_close_hook(const Close_callback& hook)
+    {
+        close_hook = hook;
+    }
     virtual void send(const boost::asio::streambuf&) = 0;
     virtual void recv(boost::asio::mutable_buffers_1) = 0;
 
+    /* Write as much of 'buffers' as the connection takes right away, in a
+     * single gathering write, without blocking.  Returns the number of
+     * bytes written; the caller must not have a send() in progress.  Sets
+     * 'ec' to would_block if nothing could be written, or to
+     * operation_not_supported if the connection cannot write
+     * synchronously. */
+    virtual size_t send_some(const Const_buffers&,
+                             boost::system::error_code& ec) = 0;
+
     virtual std::string to_string() = 0;
 
+    /* Traffic counters */
+    Connection_stats& get_stats()
+    {
+        return stats_;
+    }
+
+    const Connection_stats& get_stats() const
+    {
+        return stats_;
+    }
+
+    /* Handler memory of the receive and send paths, for statistics */
+    const handler_allocator& get_rx_allocator() const
+    {
+        return rx_allocator_;
+    }
+
+    const handler_allocator& get_tx_allocator() const
+    {
+        return tx_allocator_;
+    }
+
 protected:
     Close_callback close_cb;
     Recv_callback recv_cb;
     Send_callback send_cb;
 
+private:
+    Close_callback close_hook;
+    std::atomic<bool> closed_;
+
+protected:
+
+    Connection_stats stats_;
     handler_allocator rx_allocator_;
     handler_allocator tx_allocator_;
 };
@@ -127,15 +317,25 @@ public:
     virtual void close(const boost::system::error_code&);
     virtual void send(const boost::asio::streambuf&);
     virtual void recv(boost::asio::mutable_buffers_1);
+    virtual size_t send_some(const Const_buffers&,
+                             boost::system::error_code& ec);
 
     virtual std::string to_string();
 
 private:
     boost::shared_ptr<Async_stream> stream;
     boost::asio::strand strand;
-    size_t tx_bytes;
-    size_t rx_bytes;
+    // Size of the send() in progress
+    size_t tx_requested;
+
+    // A recv() made from within the receive callback is held back here,
+    // so that handle_recv() can first try reading the socket directly,
+    // up to MAX_DRAIN_READS times, before going through the event loop.
+    static const unsigned MAX_DRAIN_READS = 16;
+    boost::asio::mutable_buffers_1 rx_next;
+    bool rx_deferred;
 
+    void async_recv(const boost::asio::mutable_buffers_1&);
     void handle_recv(const boost::system::error_code&, const size_t&);
     void handle_send(const boost::system::error_code&, const size_t&);
 };
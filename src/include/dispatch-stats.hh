@@ -0,0 +1,153 @@
+/* Copyright 2008 (C) Nicira, Inc.
+ *
+ * This file is part of NOX.
+ *
+ * NOX is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NOX is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NOX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Event dispatch instrumentation.
+ *
+ * Counts and times every event and every handler run by the event
+ * dispatcher.  Each dispatching thread records into a shard of its own, so
+ * recording takes no lock and shares no cache line; shards are only summed
+ * up when a report is asked for, usually through the control socket. */
+
+#ifndef DISPATCH_STATS_HH
+#define DISPATCH_STATS_HH 1
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+#include "event.hh"
+
+namespace vigil
+{
+
+class Dispatch_stats
+    : boost::noncopyable
+{
+public:
+    /* Upper bound on the number of handlers tracked */
+    static const std::size_t MAX_HANDLERS = 4096;
+
+    Dispatch_stats();
+    ~Dispatch_stats();
+
+    /* Monotonic clock, in nanoseconds */
+    static uint64_t now()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    /* Allocate an id for a handler of 'event', described by 'owner' in
+     * reports.  Returns MAX_HANDLERS once all ids are in use, which
+     * record_handler() ignores. */
+    std::size_t add_handler(const Event_name& event, const std::string& owner);
+
+    /* Record one dispatch of 'n' events of 'type' taking 'ns' in total */
+    void record_event(Event_type type, uint64_t ns, Disposition,
+                      std::size_t n = 1);
+
+    /* Record one call of handler 'id', for an event of 'type' */
+    void record_handler(Event_type type, std::size_t id, uint64_t ns,
+                        Disposition, bool leaked);
+
+    /* Track the number of posted events waiting to be dispatched */
+    void posted()
+    {
+        std::size_t depth = queue_depth.fetch_add(1, std::memory_order_relaxed) + 1;
+        std::size_t max = max_queue_depth.load(std::memory_order_relaxed);
+        while (depth > max
+               && !max_queue_depth.compare_exchange_weak(max, depth))
+            ;
+    }
+
+    void dequeued()
+    {
+        queue_depth.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    /* Render a report of all counters summed over the shards, followed by
+     * the sections added by other components */
+    std::string report() const;
+
+    /* A section of the report rendered by another component, such as the
+     * traffic of each datapath */
+    typedef boost::function<std::string()> Section;
+
+    /* Append 'section' to reports, under 'title' */
+    void add_section(const std::string& title, const Section& section);
+
+private:
+    class Counters;
+    class Shard;
+
+    std::vector<std::string> handler_names;
+    std::vector<std::pair<std::string, Section> > sections;
+    mutable boost::mutex mutex;
+    std::vector<Shard*> shards;
+    boost::thread_specific_ptr<Shard> local_shard;
+
+    std::atomic<std::size_t> queue_depth;
+    std::atomic<std::size_t> max_queue_depth;
+
+    Shard& get_shard();
+    static void leave_shard(Shard*);
+    std::string counters_report() const;
+};
+
+/* Control socket for Dispatch_stats, in the manner of Vlog_server_socket,
+ * but over a Unix domain stream socket, as a report may not fit in a
+ * datagram: each client sends the "stats" request, as one line, and is
+ * sent a report, or "nak", before the connection is closed.  Only the user
+ * running NOX (and root) may connect. */
+class Dispatch_stats_socket
+    : boost::noncopyable
+{
+public:
+    Dispatch_stats_socket(boost::asio::io_service&, const Dispatch_stats&);
+    ~Dispatch_stats_socket();
+
+    /* Start answering requests on 'path', or on /tmp/nox-stats.<pid> if
+     * empty.  Throws boost::system::system_error on failure. */
+    void listen(const std::string& path = "");
+    void close();
+
+private:
+    typedef boost::asio::local::stream_protocol protocol;
+    class Session;
+
+    protocol::acceptor acceptor;
+    const Dispatch_stats& stats;
+    std::string path;
+
+    void accept();
+    void handle_accept(boost::shared_ptr<Session>,
+                       const boost::system::error_code&);
+};
+
+} // namespace vigil
+
+#endif /* dispatch-stats.hh */
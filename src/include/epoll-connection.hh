@@ -0,0 +1,148 @@
+/* Copyright 2008, 2009 (C) Nicira, Inc.
+ *
+ * This file is part of NOX.
+ *
+ * NOX is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NOX is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NOX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef EPOLL_CONNECTION_HH
+#define EPOLL_CONNECTION_HH 1
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "connection.hh"
+
+namespace vigil
+{
+
+class Epoll_connection;
+
+/* Edge-triggered epoll reactor, serving its connections from a thread of
+ * its own.  Each connection belongs to exactly one reactor and its
+ * callbacks all run on the reactor's thread, so no strand is needed; a
+ * wakeup handles every ready connection in turn, with no handler
+ * allocated per read or write. */
+class Epoll_reactor
+    : boost::noncopyable
+{
+public:
+    Epoll_reactor();
+    ~Epoll_reactor();
+
+    /* Start serving 'connection' */
+    void add(const boost::shared_ptr<Epoll_connection>& connection);
+
+    /* True on the reactor's own thread */
+    bool in_reactor_thread() const
+    {
+        return boost::this_thread::get_id() == thread.get_id();
+    }
+
+private:
+    friend class Epoll_connection;
+
+    int epoll_fd;
+    int wakeup_fd;
+    bool stopping;
+
+    boost::mutex mutex;
+    /* descriptor -> connection, keeping the connections alive */
+    boost::unordered_map<int, boost::shared_ptr<Epoll_connection> >
+        connections;
+    /* connections closed since the last wakeup */
+    std::vector<boost::shared_ptr<Epoll_connection> > retired;
+    /* work handed over by other threads */
+    std::vector<boost::function<void()> > tasks;
+
+    boost::thread thread;
+
+    void run();
+    void wakeup();
+
+    /* Run 'task' on the reactor's thread */
+    void post(const boost::function<void()>& task);
+    void remove(int fd);
+};
+
+/* Connection over a TCP socket served by an Epoll_reactor */
+class Epoll_connection
+    : public Connection
+{
+public:
+    /* Takes ownership of the connected socket 'fd' */
+    Epoll_connection(Epoll_reactor&, int fd);
+    ~Epoll_connection();
+
+    boost::shared_ptr<Epoll_connection> shared_from_this()
+    {
+        return boost::static_pointer_cast<Epoll_connection>(
+                   Connection::shared_from_this());
+    }
+
+    virtual void register_cb(Close_callback&, Recv_callback&, Send_callback&);
+
+    virtual void close(const boost::system::error_code&);
+    virtual void send(const boost::asio::streambuf&);
+    virtual void recv(boost::asio::mutable_buffers_1);
+    virtual size_t send_some(const Const_buffers&,
+                             boost::system::error_code& ec);
+
+    virtual std::string to_string();
+
+private:
+    friend class Epoll_reactor;
+
+    Epoll_reactor& reactor;
+    int fd;
+
+    /* Readiness seen through the last edges, cleared on EAGAIN */
+    bool readable;
+    bool writable;
+
+    /* Pending read and write, if any */
+    boost::asio::mutable_buffer rx;
+    boost::asio::const_buffer tx;
+    bool reading;
+    bool writing;
+
+    /* handle_events() is running */
+    bool handling;
+    /* Reads handle_events() makes before leaving the rest to the next turn
+     * of the reactor, so that a busy connection does not starve the
+     * others of its reactor */
+    static const unsigned MAX_DRAIN_READS = 16;
+    /* handle_events() is to run on the next turn of the reactor */
+    bool scheduled;
+    bool closed;
+
+    /* Everything below runs on the reactor's thread */
+    void start_recv(boost::asio::mutable_buffer);
+    void start_send(boost::asio::const_buffer);
+    void schedule();
+    void handle_scheduled();
+    void handle_events(uint32_t events);
+    void do_close(const boost::system::error_code&);
+};
+
+} // namespace vigil
+
+#endif
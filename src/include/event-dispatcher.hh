@@ -18,17 +18,26 @@
 #ifndef EVENTC_HH
 #define EVENTC_HH 1
 
-#include <set>
+#include <atomic>
+#include <deque>
+#include <limits>
+#include <list>
 #include <string>
+#include <vector>
 #include <boost/asio.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/function.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/thread.hpp>
+#include <boost/thread/tss.hpp>
 #include <boost/unordered_map.hpp>
 
+#include "batch-event.hh"
 #include "component.hh"
+#include "dispatch-stats.hh"
 #include "event.hh"
+#include "typed-event-handler.hh"
 
 namespace vigil
 {
@@ -47,6 +56,50 @@ namespace vigil
  * One convenient feature of this event dispatcher is that event handlers may
  * block without holding up processing of further events: they will be
  * dispatched by another thread.
+ *
+ * By default all threads run a single io_service.  In sharded mode each
+ * thread runs an io_service of its own (a shard) and connections are spread
+ * across the shards, so the handlers of a given connection always run on
+ * the same thread and never contend on a shared queue.  Shard 0 also
+ * carries posted events and timers.
+ *
+ * With the "stats" configuration key set, every event and handler is timed
+ * (see dispatch-stats.hh) and a report is served on the Unix socket named
+ * by "stats-socket", /tmp/nox-stats.<pid> by default.
+ *
+ * Posted events are scheduled by priority class, as configured next to the
+ * handler order of "events":
+ *
+ *   "priorities": { "ofp_echo_request": "high", "ofp_packet_in": "low" }
+ *
+ * Events of unlisted types are "normal".  Without "priorities",
+ * ofp_echo_request and Openflow_datapath_leave_event are "high".  Workers
+ * dispatch the highest class first, but once a class has been picked
+ * "starvation-limit" times in a row while a lower one waits, an event of
+ * the lower class goes next.
+ *
+ * The classes order posted events only.  OpenFlow messages are dispatched
+ * as datapaths read them, and for them the "high" class only means being
+ * dispatched at once instead of with the rest of their batch.  Until an
+ * event of a type with a queue of its own, for its class or its bound, is
+ * posted, posted events go straight to the io_service without going
+ * through the scheduler and its lock.
+ *
+ * Posted events of the types listed under "queues" wait in bounded queues
+ * of their own, e.g. for an event type some application posts:
+ *
+ *   "queues": { "Host_event": { "limit": 10000, "policy": "drop-oldest" } }
+ *
+ * Once a queue is full, post() either drops the oldest event of the queue
+ * ("drop-oldest"), the event being posted ("drop-newest"), or accepts it and
+ * asks producers to stop reading ("pause") until the queue drains to half
+ * its limit; see when_ready().  Events of the "high" class are never queued
+ * this way, so they are never shed.
+ *
+ * Only posted events are queued.  Events handed to dispatch() or
+ * dispatch_batch(), such as the OpenFlow messages datapaths dispatch as
+ * they read them, run at once whatever "queues" says; the first such event
+ * of a type with a bounded queue is logged, as its bound does not apply.
  */
 
 typedef boost::function<void(const boost::system::error_code& error)> Callback;
@@ -55,8 +108,30 @@ class Event_dispatcher
     : public Component
 {
 public:
-    /* Construct a new component instance. For nox::main() */
-    static Component* instantiate(const Component_context*, size_t n_threads);
+    /* What post() does once the queue of an event type is full */
+    enum Overflow_policy
+    {
+        DROP_OLDEST,
+        DROP_NEWEST,
+        PAUSE
+    };
+
+    /* Scheduling classes of posted events, highest first */
+    enum Priority_class
+    {
+        HIGH,
+        NORMAL,
+        LOW,
+        N_CLASSES
+    };
+
+    /* Construct a new component instance. For nox::main()
+     * With 'sharded', run one io_service per thread, and with 'pin_cpus',
+     * bind each thread to a CPU of its own. */
+    static Component* instantiate(const Component_context*, size_t n_threads,
+                                  bool sharded = false, bool pin_cpus = false);
+
+    ~Event_dispatcher();
 
     void configure();
     void install();
@@ -64,9 +139,32 @@ public:
     /* Join the threads until the end of execution */
     void join_all();
 
-    /* Post an event */
+    /* Post an event.  The caller must keep 'event' alive until it has been
+     * dispatched. */
     void post(const Event&);
 
+    /* Post an event, taking ownership of it.  The event is destroyed, or
+     * handed back to its pool (see event-pool.hh), once dispatched. */
+    void post(Event_ptr);
+
+    /* True while a queue with the "pause" policy is full.  Producers that
+     * can hold off, such as connections, should then wait for
+     * when_ready() before reading more. */
+    bool is_paused() const
+    {
+        return n_paused.load(std::memory_order_relaxed) > 0;
+    }
+
+    /* Call 'resume' once no queue is paused: right away if none is, or else
+     * from the thread draining the last paused queue. */
+    void when_ready(const boost::function<void()>& resume);
+
+    /* Get the scheduling class of events of 'type' */
+    Priority_class get_priority_class(Event_type type) const
+    {
+        return queues[type] ? queues[type]->priority : NORMAL;
+    }
+
 #if 0
     Timer post(const Callback& callback, const timeval& duration)
     {
@@ -89,11 +187,47 @@ public:
     /* Dispatch 'event' immediately, bypassing the event queue. */
     void dispatch(const Event&) const;
 
+    /* Dispatch a burst of events of the same type immediately.  The batch
+     * handlers of the type see the whole burst first; unless one of them
+     * returns STOP, the events are then dispatched one by one as by
+     * dispatch(const Event&). */
+    void dispatch_batch(const Batch_event&) const;
+
     boost::asio::io_service& get_io_service()
     {
         return io;
     }
 
+    /* Get the io_service of the shard 'key' maps to */
+    boost::asio::io_service& get_io_service(std::size_t key)
+    {
+        return *shards[key % shards.size()];
+    }
+
+    /* Get the io_service of the next shard, round robin */
+    boost::asio::io_service& next_io_service()
+    {
+        return get_io_service(next_shard++);
+    }
+
+    std::size_t get_n_shards() const
+    {
+        return shards.size();
+    }
+
+    std::size_t get_n_threads() const
+    {
+        return n_threads;
+    }
+
+    /* Append 'section' to the report of the statistics socket, under
+     * 'title'; see Dispatch_stats::add_section() */
+    void add_stats_section(const std::string& title,
+                           const Dispatch_stats::Section& section)
+    {
+        stats.add_section(title, section);
+    }
+
     /* Register an event */
     template <typename T>
     inline
@@ -110,22 +244,84 @@ public:
                           const Event_name&,
                           const Event_handler&);
 
+    /* Register a typed event handler */
+    bool register_handler(const Component_name&,
+                          const Event_name&,
+                          const Typed_event_handler&);
+
     /* Register 'handler' to be called to process each event of the given
      * 'type'.  Multiple handlers may be registered for any 'type', in which
-     * case the handlers are called in increasing order of 'order'. */
+     * case the handlers are called in increasing order of 'order'.  Handlers
+     * registered with the same order are called in registration order.
+     * Safe to call while events are being dispatched. */
     void register_handler(const Event_name&,
                           const Event_handler&, int order);
-    // TODO: unregister_handler
+
+    /* Unregister the handlers, batch handlers included, the component
+     * registered for an event.  Returns false if there were none.  Safe to
+     * call while events are being dispatched, from handlers too, but a
+     * handler may still be running, or about to run, on another thread
+     * when this returns; see synchronize(). */
+    bool unregister_handler(const Component_name&, const Event_name&);
+
+    /* True if any handler is registered for the event */
+    bool has_handlers(const Event_name&);
+
+    /* Unregister all the handlers of the component */
+    void unregister_handlers(const Component_name&);
+
+    /* Wait until no other thread is dispatching with handlers unregistered
+     * before the call, e.g. before unloading their component. */
+    void synchronize();
+
+    /* Register a batch event handler */
+    bool register_batch_handler(const Component_name&,
+                                const Event_name&,
+                                const Event_handler&);
+
+    /* Register 'handler' to be called with a Batch_event for every burst of
+     * events of the given 'type'.  Events dispatched on their own reach
+     * batch handlers as a batch of one.  Batch handlers run before the
+     * handlers of the individual events, in increasing order of 'order'. */
+    void register_batch_handler(const Event_name&,
+                                const Event_handler&, int order);
 
 private:
-    Event_dispatcher(const Component_context*, size_t n_threads);
+    Event_dispatcher(const Component_context*, size_t n_threads,
+                     bool sharded, bool pin_cpus);
 
     class Event_handler_wrapper
     {
     public:
-        Event_handler_wrapper(const Event_handler& eh, int p)
-            : event_handler(eh), priority(p)
+        Event_handler_wrapper(const Event_handler& eh, int p,
+                              const Component_name& owner_ = "")
+            : event_handler(eh), priority(p), id(Dispatch_stats::MAX_HANDLERS),
+              owner(owner_)
+        {
+        }
+
+        Event_handler_wrapper(const Typed_event_handler& teh, int p,
+                              const Component_name& owner_ = "")
+            : typed_event_handler(teh), priority(p),
+              id(Dispatch_stats::MAX_HANDLERS), owner(owner_)
+        {
+        }
+
+        /* Component that registered the handler, if any */
+        const Component_name& get_owner() const
         {
+            return owner;
+        }
+
+        /* Handler id in Dispatch_stats */
+        std::size_t get_id() const
+        {
+            return id;
+        }
+
+        void set_id(std::size_t id_)
+        {
+            id = id_;
         }
 
         bool operator<(const Event_handler_wrapper& that) const
@@ -135,19 +331,62 @@ private:
 
         Disposition operator()(const Event& event) const
         {
+            if (!typed_event_handler.empty())
+            {
+                return typed_event_handler(event);
+            }
             assert(!event_handler.empty());
             return event_handler(event);
         }
     private:
         Event_handler event_handler;
+        Typed_event_handler typed_event_handler;
         int priority;
+        std::size_t id;
+        Component_name owner;
     };
 
     typedef std::string Event_name;
     typedef boost::unordered_map<Component_name, int> Component_priority;
-    typedef std::multiset<Event_handler_wrapper> Call_chain;
+    typedef std::vector<Event_handler_wrapper> Call_chain;
     typedef boost::unordered_map<Event_name, Component_priority> Priority_map;
-    typedef boost::unordered_map<Event_name, Call_chain> Call_chain_map;
+
+    struct Dispatch_entry
+    {
+        Call_chain call_chain;
+        Call_chain batch_call_chain;
+    };
+
+    /* Event_type -> Dispatch_entry, each chain sorted by priority */
+    typedef std::vector<Dispatch_entry> Dispatch_table;
+
+    /* Queue of posted events of one type, or of all the types without a
+     * queue of their own.  Guarded by 'queue_mutex', but for 'unposted'. */
+    struct Event_queue
+    {
+        Event_queue(const Event_name& name_, Priority_class priority_,
+                    std::size_t limit_, Overflow_policy policy_)
+            : name(name_), priority(priority_), limit(limit_), policy(policy_),
+              full(false), dropped(0), unposted(false)
+        {
+        }
+
+        bool is_bounded() const
+        {
+            return limit != std::numeric_limits<std::size_t>::max();
+        }
+
+        const Event_name name;
+        const Priority_class priority;
+        const std::size_t limit;
+        const Overflow_policy policy;
+        std::deque<Event_ptr> events;
+        bool full;
+        uint64_t dropped;
+        /* set once an event of the type was dispatched without being
+         * posted */
+        std::atomic<bool> unposted;
+    };
 
     /* the io_service object and work */
     boost::asio::io_service io;
@@ -157,15 +396,95 @@ private:
     size_t n_threads;
     boost::thread_group tg;
 
+    /* the io_service of every shard, 'io' being the first */
+    std::vector<boost::asio::io_service*> shards;
+    boost::ptr_vector<boost::asio::io_service> shard_io;
+    boost::ptr_vector<boost::asio::io_service::work> shard_work;
+    std::atomic<std::size_t> next_shard;
+    bool sharded;
+    bool pin_cpus;
+
+    void run(boost::asio::io_service*, int cpu);
+
     /* guard concurrent access */
-    boost::mutex priority_map_queue_mutex;
+    mutable boost::mutex priority_map_queue_mutex;
     boost::mutex call_chain_mutex;
 
 
     // Event_name -> (Component_name -> priority)
     Priority_map priority_map;
-    // Event_name -> Call_chain
-    Call_chain_map call_chain_map;
+
+    /* The table used by dispatch().  Tables are never modified once
+     * published: writers copy the current one under 'call_chain_mutex',
+     * modify the copy and swap it in, so readers take no lock.  A replaced
+     * table is retired at the then current 'epoch', and deleted once every
+     * reader still inside dispatch() entered at a later epoch. */
+    std::atomic<const Dispatch_table*> dispatch_table;
+    typedef std::list<std::pair<uint64_t, const Dispatch_table*> >
+        Retired_list;
+    Retired_list retired;
+
+    /* dispatch instrumentation, enabled by the "stats" configuration key */
+    mutable Dispatch_stats stats;
+    bool stats_enabled;
+    std::string stats_path;
+    std::unique_ptr<Dispatch_stats_socket> stats_socket;
+
+    /* Event_type -> queue of its posted events, or null for
+     * 'default_queue'.  Set up by configure(), read-only afterwards. */
+    std::vector<Event_queue*> queues;
+    boost::ptr_vector<Event_queue> event_queues;
+    Event_queue default_queue;
+
+    /* The queue of every pending event, in posting order, by class.  Each
+     * queued event has one entry here and one task posted to the
+     * io_service, which dispatches whichever event the scheduler picks. */
+    boost::mutex queue_mutex;
+    /* set by the first event posted to a queue of its own */
+    std::atomic<bool> scheduling;
+    std::deque<Event_queue*> run_queues[N_CLASSES];
+    unsigned streaks[N_CLASSES];
+    unsigned starvation_limit;
+
+    /* number of full queues with the PAUSE policy, and the producers
+     * waiting for them to drain */
+    std::atomic<std::size_t> n_paused;
+    std::vector<boost::function<void()> > paused_readers;
+
+    /* A thread that may dispatch: the epoch it entered dispatch() at, or 0
+     * when outside */
+    struct Reader
+    {
+        Reader() : epoch(0), depth(0) {}
+
+        std::atomic<uint64_t> epoch;
+        unsigned depth;
+    };
+    class Read_guard;
+
+    mutable boost::thread_specific_ptr<Reader> local_reader;
+    mutable boost::mutex readers_mutex;
+    mutable std::vector<Reader*> readers;
+    std::atomic<uint64_t> epoch;
+
+    Reader& get_reader() const;
+    static void leave_reader(Reader*);
+    void reclaim();
+
+    void configure_queues();
+    void enqueue(Event_queue&, Event_ptr);
+    Event_queue& next_queue();
+    void dispatch_next();
+    void dispatch_posted(Event*, Event_deleter);
+    void check_unposted(Event_type) const;
+    void dispatch_event(const Event&) const;
+
+    bool get_priority(const Component_name&, const Event_name&, int&) const;
+    static bool remove_handlers(Dispatch_entry&, const Component_name&);
+    void insert_handler(Event_type, Event_handler_wrapper,
+                        const std::string& owner, Call_chain Dispatch_entry::*);
+    void publish(Dispatch_table*);
+    Disposition call(const Call_chain&, const Event&) const;
 
     Disposition handle_shutdown(const Event&);
 };
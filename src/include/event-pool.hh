@@ -0,0 +1,134 @@
+/* Copyright 2008 (C) Nicira, Inc.
+ *
+ * This file is part of NOX.
+ *
+ * NOX is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NOX is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NOX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef EVENT_POOL_HH
+#define EVENT_POOL_HH 1
+
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/type_traits/aligned_storage.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+
+#include "event.hh"
+
+namespace vigil
+{
+
+/* Per-type free list of event storage.
+ *
+ * Events built with make_event<T>() live in storage taken from the pool of
+ * T and go back to it when their Event_ptr lets go, so in steady state
+ * posting an event costs no heap allocation.  The pool keeps at most
+ * MAX_FREE idle blocks; blocks released beyond that go back to the heap.
+ *
+ * Blocks may be taken and released from any thread. */
+template <typename T>
+class Event_pool
+    : boost::noncopyable
+{
+public:
+    /* Upper bound on the idle blocks kept per type */
+    static const std::size_t MAX_FREE = 1024;
+
+    template <typename... Args>
+    static std::unique_ptr<T, Event_deleter> make(Args&&... args)
+    {
+        Event_pool& pool = instance();
+        void* p = pool.acquire();
+        T* event;
+        try
+        {
+            event = new (p) T(std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            pool.release(p);
+            throw;
+        }
+        return std::unique_ptr<T, Event_deleter>(
+            event, Event_deleter(&Event_pool::recycle));
+    }
+
+private:
+    typedef typename boost::aligned_storage<
+        sizeof(T), boost::alignment_of<T>::value>::type Storage;
+
+    boost::mutex mutex;
+    std::vector<void*> free_list;
+
+    Event_pool() {}
+
+    /* Never destroyed, as events may outlive static destructors. */
+    static Event_pool& instance()
+    {
+        static Event_pool* pool = new Event_pool;
+        return *pool;
+    }
+
+    void* acquire()
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            if (!free_list.empty())
+            {
+                void* p = free_list.back();
+                free_list.pop_back();
+                return p;
+            }
+        }
+        return new Storage;
+    }
+
+    void release(void* p)
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            if (free_list.size() < MAX_FREE)
+            {
+                free_list.push_back(p);
+                return;
+            }
+        }
+        delete static_cast<Storage*>(p);
+    }
+
+    static void recycle(Event* event)
+    {
+        T* t = static_cast<T*>(event);
+        t->~T();
+        instance().release(t);
+    }
+};
+
+/* Construct a pooled event of type T, suitable for
+ * Event_dispatcher::post(Event_ptr). */
+template <typename T, typename... Args>
+inline
+std::unique_ptr<T, Event_deleter>
+make_event(Args&&... args)
+{
+    return Event_pool<T>::make(std::forward<Args>(args)...);
+}
+
+} // namespace vigil
+
+#endif /* event-pool.hh */
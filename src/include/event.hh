@@ -18,6 +18,8 @@
 #ifndef EVENT_HH
 #define EVENT_HH 1
 
+#include <cstddef>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -28,6 +30,12 @@ enum Disposition { CONTINUE, STOP };
 
 typedef std::string Event_name;
 
+/* Small integer identifying an event name.  Ids are handed out densely,
+ * starting from zero, the first time a name is seen (normally from
+ * Event_dispatcher::register_event()) and remain valid for the lifetime of
+ * the process, so they can index flat tables. */
+typedef std::size_t Event_type;
+
 /** @defgroup noxevents NOX Events
  *
  * An Event represents a low-level or high-level event in the network.  The
@@ -56,20 +64,81 @@ public:
     virtual ~Event() {}
 
     /* Get event name */
-    Event_name get_name() const
+    const Event_name& get_name() const
     {
-        return name;
+        return lookup_name(type);
     }
 
+    /* Get event type id */
+    Event_type get_type() const
+    {
+        return type;
+    }
+
+    /* Return the type id bound to 'name', binding a new one if the name has
+     * not been seen before.  Throws std::runtime_error once MAX_TYPES
+     * distinct names have been bound. */
+    static Event_type lookup_type(const Event_name&);
+
+    /* Return the name bound to 'type'.  Lock-free; 'type' must have come
+     * from lookup_type(). */
+    static const Event_name& lookup_name(Event_type);
+
+    /* Upper bound on the number of distinct event names. */
+    static const std::size_t MAX_TYPES = 1024;
+
 protected:
-    Event(const Event_name& name_) : name(name_) {}
+    /* Construct an event of the type bound to 'name_'.  The lookup takes a
+     * global lock: event classes pass get_event_type<T>() instead. */
+    Event(const Event_name& name_) : type(lookup_type(name_)) {}
+
+    /* Construct an event of an already resolved type, avoiding the name
+     * lookup.  Preferred on hot paths. */
+    Event(Event_type type_) : type(type_) {}
+
+private:
+    const Event_type type;
+};
+
+/* Type id of the events of class 'Ev', looked up only once. */
+template <typename Ev>
+inline
+Event_type
+get_event_type()
+{
+    static const Event_type type = Event::lookup_type(Ev::static_get_name());
+    return type;
+}
+
+/* Deleter for owned events.  Events allocated from an Event_pool (see
+ * event-pool.hh) are handed back to their pool, anything else is deleted. */
+class Event_deleter
+{
+public:
+    typedef void (*Recycle)(Event*);
 
-    //void set_name(const Event_name& name_) { name = name_; }
+    Event_deleter() : recycle(0) {}
+    explicit Event_deleter(Recycle recycle_) : recycle(recycle_) {}
+
+    void operator()(Event* event) const
+    {
+        if (recycle)
+        {
+            recycle(event);
+        }
+        else
+        {
+            delete event;
+        }
+    }
 
 private:
-    const Event_name name;
+    Recycle recycle;
 };
 
+/* An owned event, as accepted by Event_dispatcher::post(Event_ptr). */
+typedef std::unique_ptr<Event, Event_deleter> Event_ptr;
+
 } // namespace vigil
 
 #endif /* event.hh */
@@ -14,6 +14,7 @@
 #include <boost/serialization/array.hpp>
 #include <boost/serialization/is_bitwise_serializable.hpp>
 
+#include "arena.hh"
 #include "network_archive.hh"
 
 namespace vigil
@@ -40,6 +41,43 @@ public:
     {
         load_binary(a.address(), a.count()*sizeof(ValueType));
     }
+    /* Skip the next 'count' bytes, returning where they lie in the buffer
+     * instead of copying them out.  They stay there until the buffer is
+     * next written to. */
+    const void* load_view(std::size_t count)
+    {
+        const void* address = boost::asio::buffer_cast<const void*>(m_sb.data());
+        m_sb.consume(count);
+        return address;
+    }
+    /* Bytes left to load */
+    std::size_t size() const
+    {
+        return m_sb.size();
+    }
+    /* The 16-bit field 'offset' bytes ahead, in host order, left in place
+     * for a later load; 0 if the buffer ends before it. */
+    uint16_t peek_uint16(std::size_t offset) const
+    {
+        if (m_sb.size() < offset + 2)
+        {
+            return 0;
+        }
+        const uint8_t* p =
+            boost::asio::buffer_cast<const uint8_t*>(m_sb.data()) + offset;
+        return uint16_t(p[0] << 8 | p[1]);
+    }
+    /* Memory for the parts of decoded objects that do not fit in the
+     * objects themselves.  The owner of the arena resets it once those
+     * objects are done with; without one they go to the heap. */
+    void set_arena(Arena* arena)
+    {
+        m_arena = arena;
+    }
+    Arena* get_arena() const
+    {
+        return m_arena;
+    }
     void load_binary(void* address, std::size_t count)
     {
         m_sb.sgetn(static_cast<char*>(address), count);
@@ -126,13 +164,14 @@ public:
 public:
     network_iarchive(boost::asio::streambuf& sbuf)
         //: archive_base_t(boost::archive::no_header | boost::archive::no_codecvt | endian_big),
-        : m_sb(sbuf)
+        : m_sb(sbuf), m_arena(0)
     {
     }
 
 private:
     //std::vector<char> & v;
     boost::asio::streambuf& m_sb;
+    Arena* m_arena;
 };
 
 typedef boost::archive::detail::polymorphic_iarchive_route<network_iarchive> polymorphic_network_iarchive;
@@ -38,6 +38,15 @@ public:
     {
         save_binary(a.address(), a.count()*sizeof(ValueType));
     }
+    /* Append 'count' bytes to the archive, returning where they lie for
+     * the caller to fill in place.  They must be written before the
+     * archive is next written to. */
+    void* save_view(std::size_t count)
+    {
+        void* address = boost::asio::buffer_cast<void*>(m_sb.prepare(count));
+        m_sb.commit(count);
+        return address;
+    }
     void save_binary(const void* address, std::size_t count)
     {
         m_sb.sputn(static_cast<const char*>(address), count);
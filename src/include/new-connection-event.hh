@@ -37,7 +37,7 @@ class New_connection_event
 {
 public:
     New_connection_event(boost::shared_ptr<Connection> conn)
-        : Event(static_get_name()), connection(conn) { }
+        : Event(get_event_type<New_connection_event>()), connection(conn) { }
 
     static const Event_name static_get_name()
     {
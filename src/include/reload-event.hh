@@ -0,0 +1,47 @@
+/* Copyright 2008, 2009 (C) Nicira, Inc.
+ *
+ * This file is part of NOX.
+ *
+ * NOX is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NOX is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NOX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef RELOAD_EVENT_HH
+#define RELOAD_EVENT_HH 1
+
+#include "event.hh"
+
+namespace vigil
+{
+
+/** \ingroup noxevents
+ *
+ * Thrown when NOX is asked to reload its configuration files, on SIGHUP.
+ * NOX shuts down on SIGHUP instead when nothing handles this event.
+ *
+ */
+
+class Reload_event
+    : public Event
+{
+public:
+    Reload_event() : Event(get_event_type<Reload_event>()) { }
+
+    static const Event_name static_get_name()
+    {
+        return "Reload_event";
+    }
+};
+
+} // namespace vigil
+
+#endif /* reload-event.hh */
@@ -0,0 +1,119 @@
+/* Copyright 2008 (C) Nicira, Inc.
+ *
+ * This file is part of NOX.
+ *
+ * NOX is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NOX is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NOX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TYPED_EVENT_HANDLER_HH
+#define TYPED_EVENT_HANDLER_HH 1
+
+#include "event.hh"
+
+namespace vigil
+{
+
+/* How a typed handler taking 'Ev' gets at the events it is registered for.
+ *
+ * By default 'Ev' is the class of the dispatched events, and the handler is
+ * passed the event itself.  An event family may specialize this to hand out
+ * a lightweight view of a more generic event instead (see
+ * Openflow_msg_event). */
+template <typename Ev>
+struct Event_traits
+{
+    typedef const Ev& argument_type;
+
+    static argument_type convert(const Event& event)
+    {
+        return static_cast<const Ev&>(event);
+    }
+};
+
+/* An event handler bound to a member function taking the event as 'Ev'.
+ *
+ * Calls go through a plain function pointer instantiated for the handler's
+ * types, with no boost::function, virtual call or cast on the handler's
+ * side. */
+class Typed_event_handler
+{
+public:
+    Typed_event_handler()
+        : type(0), thunk(0), object(0), handler(0)
+    {
+    }
+
+    template <typename Ev, typename T>
+    Typed_event_handler(T* object_, Disposition (T::*handler_)(const Ev&))
+        : type(get_event_type<Ev>()), thunk(&call<Ev, T>), object(object_),
+          handler(reinterpret_cast<Handler>(handler_))
+    {
+    }
+
+    /* Handlers returning nothing always let the event continue. */
+    template <typename Ev, typename T>
+    Typed_event_handler(T* object_, void (T::*handler_)(const Ev&))
+        : type(get_event_type<Ev>()), thunk(&call_void<Ev, T>),
+          object(object_), handler(reinterpret_cast<Handler>(handler_))
+    {
+    }
+
+    bool empty() const
+    {
+        return thunk == 0;
+    }
+
+    Event_type get_type() const
+    {
+        return type;
+    }
+
+    Disposition operator()(const Event& event) const
+    {
+        return thunk(object, handler, event);
+    }
+
+private:
+    /* Member function pointers are stored as one of an arbitrary class and
+     * cast back to their real type by the thunk. */
+    struct Any { };
+    typedef Disposition (Any::*Handler)(const Event&);
+    typedef Disposition (*Thunk)(void*, Handler, const Event&);
+
+    template <typename Ev, typename T>
+    static Disposition call(void* object, Handler handler, const Event& event)
+    {
+        typedef Disposition (T::*Typed_handler)(const Ev&);
+        return (static_cast<T*>(object)->*reinterpret_cast<Typed_handler>(handler))
+            (Event_traits<Ev>::convert(event));
+    }
+
+    template <typename Ev, typename T>
+    static Disposition call_void(void* object, Handler handler,
+                                 const Event& event)
+    {
+        typedef void (T::*Typed_handler)(const Ev&);
+        (static_cast<T*>(object)->*reinterpret_cast<Typed_handler>(handler))
+            (Event_traits<Ev>::convert(event));
+        return CONTINUE;
+    }
+
+    Event_type type;
+    Thunk thunk;
+    void* object;
+    Handler handler;
+};
+
+} // namespace vigil
+
+#endif /* typed-event-handler.hh */
@@ -0,0 +1,198 @@
+/* Copyright 2008 (C) Nicira, Inc.
+ *
+ * This file is part of NOX.
+ *
+ * NOX is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NOX is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NOX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef WIRE_LAYOUT_HH
+#define WIRE_LAYOUT_HH 1
+
+#include <stdint.h>
+#include <vector>
+#include <boost/mpl/bool.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/serialization/binary_object.hpp>
+
+#include "network_iarchive.hh"
+#include "network_oarchive.hh"
+
+namespace vigil
+{
+
+/* Where the fields of a fixed-size structure lie, in its objects and on
+ * the wire.
+ *
+ * The layout of T is recorded once, by running T::serialize() over a
+ * Wire_layout::Recorder: every integer is a field to byte-swap, every
+ * binary object a field to copy as is.  A structure is then decoded or
+ * encoded in one pass over its wire bytes, taken from or appended to a
+ * network archive at once, instead of with a streambuf call and a swap
+ * per field.  On processors with SSSE3, when the compiler can build for
+ * it, all the fields of each 16 bytes of the wire format are swapped
+ * with a single byte shuffle.
+ *
+ * Variable-length members, such as action lists, are left out of the
+ * layout by an overload of record_member() that records nothing, and have
+ * to be serialized after it. */
+class Wire_layout
+    : boost::noncopyable
+{
+public:
+    struct Field
+    {
+        uint16_t object_offset;
+        uint16_t wire_offset;
+        uint16_t size;
+        bool swap;
+    };
+
+    /* Archive recording the fields of a structure as it is saved */
+    class Recorder
+    {
+    public:
+        typedef boost::mpl::bool_<false> is_loading;
+        typedef boost::mpl::bool_<true> is_saving;
+
+        Recorder(Wire_layout& layout_, const void* object_)
+            : layout(layout_), object(static_cast<const char*>(object_)) {}
+
+        Recorder& operator&(const uint8_t& t)
+        {
+            layout.add(static_cast<const char*>(static_cast<const void*>(&t))
+                       - object, 1, false);
+            return *this;
+        }
+        Recorder& operator&(const uint16_t& t)
+        {
+            return field(&t, 2);
+        }
+        Recorder& operator&(const uint32_t& t)
+        {
+            return field(&t, 4);
+        }
+        Recorder& operator&(const uint64_t& t)
+        {
+            return field(&t, 8);
+        }
+        Recorder& operator&(const boost::serialization::binary_object& b)
+        {
+            layout.add(static_cast<const char*>(b.m_t) - object,
+                       b.m_size, false);
+            return *this;
+        }
+        template<class T>
+        Recorder& operator&(const T& t)
+        {
+            record_member(*this, const_cast<T&>(t));
+            return *this;
+        }
+
+    private:
+        Wire_layout& layout;
+        const char* object;
+
+        Recorder& field(const void* t, std::size_t size)
+        {
+            layout.add(static_cast<const char*>(t) - object, size, true);
+            return *this;
+        }
+    };
+
+    /* The layout of T, recorded on first use */
+    template<class T>
+    static const Wire_layout& of()
+    {
+        static const Wire_layout& layout = record<T>();
+        return layout;
+    }
+
+    /* Bytes taken on the wire */
+    std::size_t size() const
+    {
+        return wire_size;
+    }
+
+    void decode(const uint8_t* wire, void* object) const;
+    void encode(const void* object, uint8_t* wire) const;
+
+    /* Upper bound on size() */
+    static const std::size_t MAX_SIZE = 256;
+
+private:
+    std::vector<Field> fields;
+    std::size_t wire_size;
+    /* One byte shuffle per 16 bytes of the wire format, if in use */
+    std::vector<uint8_t> shuffles;
+
+    Wire_layout() : wire_size(0) {}
+
+    template<class T>
+    static const Wire_layout& record()
+    {
+        /* Never destroyed, as it may be used by static destructors. */
+        Wire_layout* layout = new Wire_layout;
+        T t;
+        Recorder recorder(*layout, &t);
+        t.serialize(recorder, 0);
+        layout->finish();
+        return *layout;
+    }
+
+    void add(std::size_t object_offset, std::size_t size, bool swap);
+    void finish();
+};
+
+/* Record the fields of a structure member */
+template<class T>
+inline void
+record_member(Wire_layout::Recorder& recorder, T& t)
+{
+    t.serialize(recorder, 0);
+}
+
+/* Decode or encode 't' in one pass through a network archive, returning
+ * true; other archives, and archives holding less than all of 't', get
+ * false and go field by field. */
+template<class Archive, class T>
+inline bool
+serialize_bulk(Archive&, T&)
+{
+    return false;
+}
+
+template<class T>
+inline bool
+serialize_bulk(network_iarchive& ar, T& t)
+{
+    const Wire_layout& layout = Wire_layout::of<T>();
+    if (ar.size() < layout.size())
+    {
+        return false;
+    }
+    layout.decode(static_cast<const uint8_t*>(ar.load_view(layout.size())), &t);
+    return true;
+}
+
+template<class T>
+inline bool
+serialize_bulk(network_oarchive& ar, T& t)
+{
+    const Wire_layout& layout = Wire_layout::of<T>();
+    layout.encode(&t, static_cast<uint8_t*>(ar.save_view(layout.size())));
+    return true;
+}
+
+} // namespace vigil
+
+#endif /* wire-layout.hh */
@@ -17,6 +17,7 @@
  */
 #include <config.h>
 #include <inttypes.h>
+#include <sys/time.h>
 #include <algorithm>
 #include <sstream>
 #include <utility>
@@ -89,7 +90,93 @@ inline custom_alloc_handler<Handler> make_custom_alloc_handler(
     return custom_alloc_handler<Handler>(a, h);
 }
 
+typedef boost::asio::ip::tcp::socket tcp_socket;
+typedef boost::asio::ssl::stream<tcp_socket> ssl_socket;
+typedef boost::asio::local::stream_protocol::socket unix_socket;
+
+/* Non-blocking gathering write, i.e. writev(), on the socket */
+static size_t
+write_now(tcp_socket& socket, const Connection::Const_buffers& buffers,
+          bs::error_code& ec)
+{
+    return socket.write_some(buffers, ec);
+}
+
+static size_t
+write_now(unix_socket& socket, const Connection::Const_buffers& buffers,
+          bs::error_code& ec)
+{
+    return socket.write_some(buffers, ec);
+}
+
+/* A synchronous SSL write could be left halfway through a record by a full
+ * socket, so SSL connections always go through send(). */
+static size_t
+write_now(ssl_socket&, const Connection::Const_buffers&, bs::error_code& ec)
+{
+    ec = ba::error::operation_not_supported;
+    return 0;
+}
+
+/* Non-blocking read on the socket */
+static size_t
+read_now(tcp_socket& socket, const ba::mutable_buffers_1& buffer,
+         bs::error_code& ec)
+{
+    return socket.read_some(buffer, ec);
+}
+
+static size_t
+read_now(unix_socket& socket, const ba::mutable_buffers_1& buffer,
+         bs::error_code& ec)
+{
+    return socket.read_some(buffer, ec);
+}
+
+/* Neither may a synchronous SSL read stop halfway through a record */
+static size_t
+read_now(ssl_socket&, const ba::mutable_buffers_1&, bs::error_code& ec)
+{
+    ec = ba::error::operation_not_supported;
+    return 0;
+}
+
+/* The connection whose receive callback runs on this thread, if any */
+static __thread const Connection* receiving = 0;
+
+Connection_stats::Connection_stats()
+    : tx_bytes_(0), rx_bytes_(0), tx_msgs_(0), rx_msgs_(0), reads_(0),
+      writes_(0), partial_writes_(0), tx_queue_max_(0), last_activity_(0)
+{
+}
+
+void
+Connection_stats::touch()
+{
+    timeval now;
+    gettimeofday(&now, 0);
+    last_activity_.store(uint64_t(now.tv_sec) * 1000000 + now.tv_usec,
+                         std::memory_order_relaxed);
+}
+
+Connection_stats::Snapshot
+Connection_stats::snapshot() const
+{
+    Snapshot s;
+    s.tx_bytes = tx_bytes_.load(std::memory_order_relaxed);
+    s.rx_bytes = rx_bytes_.load(std::memory_order_relaxed);
+    s.tx_msgs = tx_msgs_.load(std::memory_order_relaxed);
+    s.rx_msgs = rx_msgs_.load(std::memory_order_relaxed);
+    s.reads = reads_.load(std::memory_order_relaxed);
+    s.writes = writes_.load(std::memory_order_relaxed);
+    s.partial_writes = partial_writes_.load(std::memory_order_relaxed);
+    s.tx_queue_max = tx_queue_max_.load(std::memory_order_relaxed);
+    s.last_activity = last_activity_.load(std::memory_order_relaxed);
+    return s;
+}
+
 Connection::Connection()
+    : closed_(false)
 {
 }
 
@@ -97,6 +184,10 @@ void
 Connection::close(const bs::error_code& ec)
 {
     close_cb();
+    if (!closed_.exchange(true) && !close_hook.empty())
+    {
+        close_hook();
+    }
 }
 
 /* Constructs a Openflow connection that takes over ownership of 'stream'. */
@@ -104,9 +195,9 @@ template <typename Async_stream>
 Stream_connection<Async_stream>::Stream_connection(
     boost::shared_ptr<Async_stream> stream)
     : Connection(), stream(stream), strand(stream->get_io_service()),
-      tx_bytes(0), rx_bytes(0)
+      tx_requested(0), rx_next(ba::mutable_buffer()), rx_deferred(false)
 {
-    ba::ip::tcp::socket::non_blocking_io non_blocking_io(true);
+    ba::socket_base::non_blocking_io non_blocking_io(true);
     stream->lowest_layer().io_control(non_blocking_io);
 }
 
@@ -114,7 +205,14 @@ Stream_connection<Async_stream>::Stream_connection(
 template <typename Async_stream>
 Stream_connection<Async_stream>::~Stream_connection()
 {
-    VLOG_DBG(lg, "flushed (tx: %zu, rx: %zu)", tx_bytes, rx_bytes);
+    const Connection_stats::Snapshot s = stats_.snapshot();
+    VLOG_DBG(lg, "flushed (tx: %" PRIu64 ", rx: %" PRIu64 ")",
+             s.tx_bytes, s.rx_bytes);
+    VLOG_DBG(lg, "handler memory hits/misses (tx: %" PRIu64 "/%" PRIu64
+             ", rx: %" PRIu64 "/%" PRIu64 "), largest %zu",
+             tx_allocator_.hits(), tx_allocator_.misses(),
+             rx_allocator_.hits(), rx_allocator_.misses(),
+             std::max(tx_allocator_.largest(), rx_allocator_.largest()));
 }
 
 template <typename Async_stream>
@@ -139,6 +237,7 @@ template <typename Async_stream>
 void
 Stream_connection<Async_stream>::send(const ba::streambuf& buf)
 {
+    tx_requested = buf.size();
     stream->async_write_some(buf.data(),
                              make_custom_alloc_handler(tx_allocator_,
                                                        strand.wrap(boost::bind(&Stream_connection::handle_send,
@@ -151,19 +250,43 @@ template <typename Async_stream>
 void
 Stream_connection<Async_stream>::recv(ba::mutable_buffers_1 buf)
 {
-    /*if (stream->lowest_layer().available() > 0) {
-        bs::error_code ec;
-        size_t bytes_transferred =
-            stream->read_some(buf.prepare(buf.max_size() - buf.size()), ec);
-        handle_recv(ec, bytes_transferred);
-    } else {*/
+    if (receiving == this)
+    {
+        rx_next = buf;
+        rx_deferred = true;
+        return;
+    }
+    async_recv(buf);
+}
+
+template <typename Async_stream>
+void
+Stream_connection<Async_stream>::async_recv(const ba::mutable_buffers_1& buf)
+{
     stream->async_read_some(buf,
                             make_custom_alloc_handler(rx_allocator_,
                                                       strand.wrap(boost::bind(&Stream_connection<Async_stream>::handle_recv,
                                                               shared_from_this(),
                                                               ba::placeholders::error,
                                                               ba::placeholders::bytes_transferred))));
-    //}
+}
+
+template <typename Async_stream>
+size_t
+Stream_connection<Async_stream>::send_some(const Const_buffers& buffers,
+                                           bs::error_code& ec)
+{
+    const size_t n = write_now(*stream, buffers, ec);
+    if (ec != ba::error::operation_not_supported)
+    {
+        size_t requested = 0;
+        BOOST_FOREACH(const ba::const_buffer& b, buffers)
+        {
+            requested += ba::buffer_size(b);
+        }
+        stats_.wrote(n, requested);
+    }
+    return n;
 }
 
 template <typename Async_stream>
@@ -179,19 +302,50 @@ Stream_connection<Async_stream>::handle_recv(const bs::error_code& ec,
         close(ec);
         return;
     }
-    rx_bytes += bytes_transferred;
-    try
-    {
-        recv_cb(bytes_transferred);
-    }
-    catch (const std::exception& e)
+    stats_.read(bytes_transferred);
+
+    // While the socket has more for us, keep reading it directly.  A read
+    // that would block, or fails, goes through the event loop instead,
+    // which waits or reports the error.
+    size_t n = bytes_transferred;
+    for (unsigned reads = 1; ; reads++)
     {
-        VLOG_ERR(lg, "Exception in recv callback: %s", e.what());
-        VLOG_ERR(lg, "Extra information:\n%s",
-                 boost::current_exception_diagnostic_information().c_str());
-        close(ec);
-    }
+        const Connection* outer = receiving;
+        receiving = this;
+        rx_deferred = false;
+        try
+        {
+            recv_cb(n);
+        }
+        catch (const std::exception& e)
+        {
+            receiving = outer;
+            VLOG_ERR(lg, "Exception in recv callback: %s", e.what());
+            VLOG_ERR(lg, "Extra information:\n%s",
+                     boost::current_exception_diagnostic_information().c_str());
+            close(ec);
+            return;
+        }
+        receiving = outer;
+
+        if (!rx_deferred)
+        {
+            return;
+        }
+        if (reads == MAX_DRAIN_READS)
+        {
+            break;
+        }
 
+        bs::error_code read_ec;
+        n = read_now(*stream, rx_next, read_ec);
+        if (read_ec)
+        {
+            break;
+        }
+        stats_.read(n);
+    }
+    async_recv(rx_next);
 }
 
 template <typename Async_stream>
@@ -207,7 +361,7 @@ Stream_connection<Async_stream>::handle_send(const bs::error_code& ec,
         close(ec);
         return;
     }
-    tx_bytes += bytes_transferred;
+    stats_.wrote(bytes_transferred, tx_requested);
     try
     {
         send_cb(bytes_transferred);
@@ -233,10 +387,8 @@ Stream_connection<Async_stream>::to_string()
     return ss.str();
 }
 
-typedef boost::asio::ip::tcp::socket tcp_socket;
-typedef boost::asio::ssl::stream<tcp_socket> ssl_socket;
-
 template class Stream_connection<ssl_socket>;
 template class Stream_connection<tcp_socket>;
+template class Stream_connection<unix_socket>;
 
 } // namespace vigil
@@ -0,0 +1,508 @@
+/* Copyright 2008, 2009 (C) Nicira, Inc.
+ *
+ * This file is part of NOX.
+ *
+ * NOX is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NOX is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NOX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "epoll-connection.hh"
+
+#include <config.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <sstream>
+#include <boost/bind.hpp>
+#include <boost/exception/all.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "assert.hh"
+#include "errno_exception.hh"
+#include "vlog.hh"
+
+namespace vigil
+{
+
+namespace ba = ::boost::asio;
+namespace bs = ::boost::system;
+
+static Vlog_module lg("epoll-connection");
+
+Epoll_reactor::Epoll_reactor()
+    : epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+      wakeup_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      stopping(false)
+{
+    if (epoll_fd < 0)
+    {
+        throw errno_exception(errno, "epoll_create1");
+    }
+    if (wakeup_fd < 0)
+    {
+        int error = errno;
+        ::close(epoll_fd);
+        throw errno_exception(error, "eventfd");
+    }
+
+    // The wakeup descriptor is told apart by its null pointer
+    epoll_event ev = epoll_event();
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = 0;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev);
+
+    thread = boost::thread(boost::bind(&Epoll_reactor::run, this));
+}
+
+Epoll_reactor::~Epoll_reactor()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeup();
+    thread.join();
+
+    connections.clear();
+    retired.clear();
+    ::close(wakeup_fd);
+    ::close(epoll_fd);
+}
+
+void
+Epoll_reactor::add(const boost::shared_ptr<Epoll_connection>& connection)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        connections[connection->fd] = connection;
+    }
+
+    // Registered once, for both directions: edges tell when to resume
+    epoll_event ev = epoll_event();
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = connection.get();
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection->fd, &ev) < 0)
+    {
+        int error = errno;
+        remove(connection->fd);
+        throw errno_exception(error, "epoll_ctl");
+    }
+}
+
+void
+Epoll_reactor::remove(int fd)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, 0);
+
+    boost::lock_guard<boost::mutex> lock(mutex);
+    boost::unordered_map<int, boost::shared_ptr<Epoll_connection> >::iterator
+        it = connections.find(fd);
+    if (it != connections.end())
+    {
+        // Events already fetched may still point to the connection: keep
+        // it until they have been handled
+        retired.push_back(it->second);
+        connections.erase(it);
+    }
+}
+
+void
+Epoll_reactor::post(const boost::function<void()>& task)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        tasks.push_back(task);
+    }
+    wakeup();
+}
+
+void
+Epoll_reactor::wakeup()
+{
+    const uint64_t one = 1;
+    if (write(wakeup_fd, &one, sizeof one) < 0 && errno != EAGAIN)
+    {
+        VLOG_ERR(lg, "cannot wake up reactor: %s", strerror(errno));
+    }
+}
+
+void
+Epoll_reactor::run()
+{
+    static const int MAX_EVENTS = 64;
+    epoll_event events[MAX_EVENTS];
+    std::vector<boost::function<void()> > ready;
+
+    for (;;)
+    {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            VLOG_ERR(lg, "epoll_wait failed: %s", strerror(errno));
+            return;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            Epoll_connection* c =
+                static_cast<Epoll_connection*>(events[i].data.ptr);
+            if (!c)
+            {
+                uint64_t count;
+                while (read(wakeup_fd, &count, sizeof count) > 0)
+                    ;
+                continue;
+            }
+
+            // A callback may close the connection and drop the last
+            // reference to it
+            boost::shared_ptr<Epoll_connection> keep(c->shared_from_this());
+            c->handle_events(events[i].events);
+        }
+
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            if (stopping)
+            {
+                return;
+            }
+            ready.swap(tasks);
+        }
+        BOOST_FOREACH(const boost::function<void()>& task, ready)
+        {
+            task();
+        }
+        ready.clear();
+
+        std::vector<boost::shared_ptr<Epoll_connection> > dead;
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            dead.swap(retired);
+        }
+    }
+}
+
+Epoll_connection::Epoll_connection(Epoll_reactor& reactor_, int fd_)
+    : Connection(), reactor(reactor_), fd(fd_), readable(true), writable(true),
+      reading(false), writing(false), handling(false), scheduled(false),
+      closed(false)
+{
+}
+
+Epoll_connection::~Epoll_connection()
+{
+    const Connection_stats::Snapshot s = stats_.snapshot();
+    VLOG_DBG(lg, "flushed (tx: %" PRIu64 ", rx: %" PRIu64 ")",
+             s.tx_bytes, s.rx_bytes);
+    if (!closed)
+    {
+        ::close(fd);
+    }
+}
+
+void
+Epoll_connection::register_cb(Close_callback& ccb, Recv_callback& rcb,
+                              Send_callback& scb)
+{
+    close_cb = ccb;
+    recv_cb = rcb;
+    send_cb = scb;
+}
+
+void
+Epoll_connection::close(const bs::error_code& ec)
+{
+    if (reactor.in_reactor_thread())
+    {
+        do_close(ec);
+    }
+    else
+    {
+        reactor.post(boost::bind(&Epoll_connection::do_close,
+                                 shared_from_this(), ec));
+    }
+}
+
+void
+Epoll_connection::send(const ba::streambuf& buf)
+{
+    const ba::const_buffer data = *buf.data().begin();
+    if (reactor.in_reactor_thread())
+    {
+        tx = data;
+        writing = true;
+        if (!handling)
+        {
+            schedule();
+        }
+    }
+    else
+    {
+        reactor.post(boost::bind(&Epoll_connection::start_send,
+                                 shared_from_this(), data));
+    }
+}
+
+void
+Epoll_connection::recv(ba::mutable_buffers_1 buf)
+{
+    const ba::mutable_buffer data = *buf.begin();
+    if (reactor.in_reactor_thread())
+    {
+        rx = data;
+        reading = true;
+        if (!handling)
+        {
+            schedule();
+        }
+    }
+    else
+    {
+        reactor.post(boost::bind(&Epoll_connection::start_recv,
+                                 shared_from_this(), data));
+    }
+}
+
+size_t
+Epoll_connection::send_some(const Const_buffers& buffers, bs::error_code& ec)
+{
+    std::vector<iovec> iov;
+    iov.reserve(buffers.size());
+    size_t requested = 0;
+    BOOST_FOREACH(const ba::const_buffer& b, buffers)
+    {
+        iovec v;
+        v.iov_base = const_cast<void*>(ba::buffer_cast<const void*>(b));
+        v.iov_len = ba::buffer_size(b);
+        iov.push_back(v);
+        requested += v.iov_len;
+    }
+
+    msghdr msg = msghdr();
+    msg.msg_iov = &iov[0];
+    msg.msg_iovlen = iov.size();
+    ssize_t n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0)
+    {
+        ec = bs::error_code(errno, bs::get_system_category());
+        return 0;
+    }
+    ec = bs::error_code();
+    stats_.wrote(n, requested);
+    return n;
+}
+
+std::string
+Epoll_connection::to_string()
+{
+    ba::ip::tcp::endpoint local, remote;
+    socklen_t local_len = local.capacity();
+    socklen_t remote_len = remote.capacity();
+    getsockname(fd, local.data(), &local_len);
+    getpeername(fd, remote.data(), &remote_len);
+
+    std::stringstream ss;
+    ss << local << "<->" << remote;
+    return ss.str();
+}
+
+/* Run by the reactor for send() and recv() called from other threads, with
+ * no lock held.  The callbacks may call send() and recv() in turn:
+ * handle_events() then picks the new operation up as it loops, until
+ * there is nothing left to do or the socket would block. */
+void
+Epoll_connection::start_recv(ba::mutable_buffer buf)
+{
+    rx = buf;
+    reading = true;
+    if (!handling)
+    {
+        handle_events(0);
+    }
+}
+
+void
+Epoll_connection::start_send(ba::const_buffer buf)
+{
+    tx = buf;
+    writing = true;
+    if (!handling)
+    {
+        handle_events(0);
+    }
+}
+
+/* send() and recv() called on the reactor's thread from outside the
+ * connection's own callbacks leave the operation to the next turn of the
+ * reactor: the caller may hold a lock that the completion callback takes,
+ * as Openflow_datapath::send() holds the one of its send callback.  So do
+ * reads past MAX_DRAIN_READS. */
+void
+Epoll_connection::schedule()
+{
+    if (!scheduled)
+    {
+        scheduled = true;
+        reactor.post(boost::bind(&Epoll_connection::handle_scheduled,
+                                 shared_from_this()));
+    }
+}
+
+void
+Epoll_connection::handle_scheduled()
+{
+    scheduled = false;
+    handle_events(0);
+}
+
+void
+Epoll_connection::handle_events(uint32_t events)
+{
+    if (closed)
+    {
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    {
+        readable = true;
+    }
+    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+    {
+        writable = true;
+    }
+    if (handling)
+    {
+        return;
+    }
+    handling = true;
+
+    unsigned reads = 0;
+    bool progress = true;
+    while (progress && !closed)
+    {
+        progress = false;
+
+        if (writing && writable)
+        {
+            ssize_t n = ::send(fd, ba::buffer_cast<const void*>(tx),
+                               ba::buffer_size(tx),
+                               MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n >= 0)
+            {
+                writing = false;
+                progress = true;
+                stats_.wrote(n, ba::buffer_size(tx));
+                try
+                {
+                    send_cb(n);
+                }
+                catch (const std::exception& e)
+                {
+                    VLOG_ERR(lg, "Exception in send callback: %s", e.what());
+                    VLOG_ERR(lg, "Extra information:\n%s",
+                             boost::current_exception_diagnostic_information().c_str());
+                    do_close(bs::error_code());
+                }
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                writable = false;
+            }
+            else if (errno == EINTR)
+            {
+                progress = true;
+            }
+            else
+            {
+                bs::error_code ec(errno, bs::get_system_category());
+                VLOG_WARN(lg, "tx error (%s)", ec.message().c_str());
+                do_close(ec);
+            }
+        }
+
+        if (reading && readable && !closed && reads < MAX_DRAIN_READS)
+        {
+            ssize_t n = ::recv(fd, ba::buffer_cast<void*>(rx),
+                               ba::buffer_size(rx), MSG_DONTWAIT);
+            if (n > 0)
+            {
+                reading = false;
+                progress = true;
+                reads++;
+                stats_.read(n);
+                try
+                {
+                    recv_cb(n);
+                }
+                catch (const std::exception& e)
+                {
+                    VLOG_ERR(lg, "Exception in recv callback: %s", e.what());
+                    VLOG_ERR(lg, "Extra information:\n%s",
+                             boost::current_exception_diagnostic_information().c_str());
+                    do_close(bs::error_code());
+                }
+            }
+            else if (n == 0)
+            {
+                do_close(ba::error::eof);
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                readable = false;
+            }
+            else if (errno == EINTR)
+            {
+                progress = true;
+            }
+            else
+            {
+                bs::error_code ec(errno, bs::get_system_category());
+                VLOG_WARN(lg, "rx error (%s)", ec.message().c_str());
+                do_close(ec);
+            }
+        }
+    }
+
+    handling = false;
+    if (reading && readable && !closed)
+    {
+        // Drained as much as allowed: 'readable' still holds, as no
+        // EAGAIN was seen, so no new edge would come
+        schedule();
+    }
+}
+
+void
+Epoll_connection::do_close(const bs::error_code& ec)
+{
+    if (closed)
+    {
+        return;
+    }
+    closed = true;
+    reading = writing = false;
+
+    Connection::close(ec);
+    reactor.remove(fd);
+    ::close(fd);
+}
+
+} // namespace vigil
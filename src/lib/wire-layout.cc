@@ -0,0 +1,257 @@
+/* Copyright 2008 (C) Nicira, Inc.
+ *
+ * This file is part of NOX.
+ *
+ * NOX is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NOX is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NOX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "wire-layout.hh"
+
+#include <config.h>
+#include <byteswap.h>
+#include <string.h>
+#include <cassert>
+#include <boost/detail/endian.hpp>
+#include <boost/foreach.hpp>
+
+#if defined(__SSSE3__) || defined(HAVE_SSSE3_DISPATCH)
+#define WIRE_LAYOUT_SHUFFLE 1
+#include <tmmintrin.h>
+#endif
+
+namespace vigil
+{
+
+const std::size_t Wire_layout::MAX_SIZE;
+
+#ifdef WIRE_LAYOUT_SHUFFLE
+// Built for SSSE3 whatever the flags, and only called once the processor
+// is known to have it
+#ifndef __SSSE3__
+__attribute__((target("ssse3")))
+#endif
+static void
+shuffle_blocks(uint8_t* host, const uint8_t* shuffles, std::size_t blocks)
+{
+    for (std::size_t i = 0; i < blocks; i++)
+    {
+        __m128i* block = reinterpret_cast<__m128i*>(host + i * 16);
+        const __m128i shuffle = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(shuffles + i * 16));
+        _mm_storeu_si128(block,
+                         _mm_shuffle_epi8(_mm_loadu_si128(block), shuffle));
+    }
+}
+
+static bool
+have_ssse3()
+{
+#ifdef __SSSE3__
+    return true;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+#endif
+
+void
+Wire_layout::add(std::size_t object_offset, std::size_t size, bool swap)
+{
+#ifndef BOOST_LITTLE_ENDIAN
+    swap = false;
+#endif
+    swap = swap && size > 1;
+
+    // Runs of bytes copied as is are merged while they stay contiguous
+    // in the object as well as on the wire
+    if (!swap && !fields.empty())
+    {
+        Field& last = fields.back();
+        if (!last.swap && last.object_offset + last.size == object_offset)
+        {
+            last.size += size;
+            wire_size += size;
+            return;
+        }
+    }
+
+    Field field;
+    field.object_offset = object_offset;
+    field.wire_offset = wire_size;
+    field.size = size;
+    field.swap = swap;
+    fields.push_back(field);
+    wire_size += size;
+}
+
+void
+Wire_layout::finish()
+{
+    assert(wire_size <= MAX_SIZE);
+
+#ifdef WIRE_LAYOUT_SHUFFLE
+    // Each 16 bytes are put in host order by one shuffle, as long as no
+    // field to swap spans two of them; each byte is sent to its mirror
+    // position within its field.
+    if (!have_ssse3())
+    {
+        return;
+    }
+    shuffles.resize((wire_size + 15) / 16 * 16);
+    for (std::size_t i = 0; i < shuffles.size(); i++)
+    {
+        shuffles[i] = i % 16;
+    }
+    BOOST_FOREACH(const Field& field, fields)
+    {
+        if (!field.swap)
+        {
+            continue;
+        }
+        const std::size_t first = field.wire_offset;
+        const std::size_t last = field.wire_offset + field.size - 1;
+        if (first / 16 != last / 16)
+        {
+            shuffles.clear();
+            return;
+        }
+        for (std::size_t i = first; i <= last; i++)
+        {
+            shuffles[i] = (first + last - i) % 16;
+        }
+    }
+#endif
+}
+
+void
+Wire_layout::decode(const uint8_t* wire, void* object) const
+{
+    uint8_t* o = static_cast<uint8_t*>(object);
+
+#ifdef WIRE_LAYOUT_SHUFFLE
+    if (!shuffles.empty())
+    {
+        uint8_t h[MAX_SIZE];
+        const std::size_t blocks = shuffles.size() / 16;
+        memset(h + (blocks - 1) * 16, 0, 16);
+        memcpy(h, wire, wire_size);
+        shuffle_blocks(h, &shuffles[0], blocks);
+        BOOST_FOREACH(const Field& field, fields)
+        {
+            memcpy(o + field.object_offset, h + field.wire_offset, field.size);
+        }
+        return;
+    }
+#endif
+
+    BOOST_FOREACH(const Field& field, fields)
+    {
+        const uint8_t* w = wire + field.wire_offset;
+        uint8_t* p = o + field.object_offset;
+        if (!field.swap)
+        {
+            memcpy(p, w, field.size);
+            continue;
+        }
+        switch (field.size)
+        {
+        case 2:
+        {
+            uint16_t x;
+            memcpy(&x, w, 2);
+            x = bswap_16(x);
+            memcpy(p, &x, 2);
+            break;
+        }
+        case 4:
+        {
+            uint32_t x;
+            memcpy(&x, w, 4);
+            x = bswap_32(x);
+            memcpy(p, &x, 4);
+            break;
+        }
+        case 8:
+        {
+            uint64_t x;
+            memcpy(&x, w, 8);
+            x = bswap_64(x);
+            memcpy(p, &x, 8);
+            break;
+        }
+        }
+    }
+}
+
+void
+Wire_layout::encode(const void* object, uint8_t* wire) const
+{
+    const uint8_t* o = static_cast<const uint8_t*>(object);
+
+#ifdef WIRE_LAYOUT_SHUFFLE
+    if (!shuffles.empty())
+    {
+        // The shuffles are their own inverse
+        uint8_t h[MAX_SIZE];
+        const std::size_t blocks = shuffles.size() / 16;
+        BOOST_FOREACH(const Field& field, fields)
+        {
+            memcpy(h + field.wire_offset, o + field.object_offset, field.size);
+        }
+        shuffle_blocks(h, &shuffles[0], blocks);
+        memcpy(wire, h, wire_size);
+        return;
+    }
+#endif
+
+    BOOST_FOREACH(const Field& field, fields)
+    {
+        const uint8_t* p = o + field.object_offset;
+        uint8_t* w = wire + field.wire_offset;
+        if (!field.swap)
+        {
+            memcpy(w, p, field.size);
+            continue;
+        }
+        switch (field.size)
+        {
+        case 2:
+        {
+            uint16_t x;
+            memcpy(&x, p, 2);
+            x = bswap_16(x);
+            memcpy(w, &x, 2);
+            break;
+        }
+        case 4:
+        {
+            uint32_t x;
+            memcpy(&x, p, 4);
+            x = bswap_32(x);
+            memcpy(w, &x, 4);
+            break;
+        }
+        case 8:
+        {
+            uint64_t x;
+            memcpy(&x, p, 8);
+            x = bswap_64(x);
+            memcpy(w, &x, 8);
+            break;
+        }
+        }
+    }
+}
+
+} // namespace vigil
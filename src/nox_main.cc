@@ -81,6 +81,7 @@
 #include "event.hh"
 #include "fault.hh"
 #include "kernel.hh"
+#include "reload-event.hh"
 #include "shutdown-event.hh"
 #include "static-deployer.hh"
 #include "vlog.hh"
@@ -157,9 +158,14 @@ void usage(const char* program_name)
            "\nInterface options (specify any number):\n"
            "  -i ptcp:[IP]:[PORT]     listen to TCP PORT on interface specified by IP\n"
            "                          (default: 0.0.0.0:%d)\n"
+           "  -i ptcp-epoll:[IP]:[PORT]\n"
+           "                          like ptcp, served by edge-triggered epoll\n"
+           "                          reactors instead of the event loop\n"
            "  -i pssl:[IP]:[PORT]:KEY:CERT:CONTROLLER_CA_CERT\n"
            "                          listen to SSL PORT on interface specified by IP\n"
            "                          (default: 0.0.0.0:%d)\n"
+           "  -i punix:PATH           listen on the Unix domain socket PATH\n"
+           "  -i unix:PATH            connect to the Unix domain socket PATH\n"
 #ifdef UNRELIABLE_ENABLED
            "\nNetwork control options (must also specify an interface):\n"
            "  -u, --unreliable        do not reconnect to interfaces on error\n"
@@ -173,6 +179,9 @@ void usage(const char* program_name)
            "  -n, --info=FILE         set controller info file\n"
            "  -p, --pid=FILE          set pid file\n"
            "  -t, --threads=COUNT     set the number of threads\n"
+           "  -s, --sharded           run one event loop per thread and spread\n"
+           "                          connections across them\n"
+           "  -a, --affinity          pin each thread to a CPU\n"
            "  -v, --verbose           set maximum verbosity level (for console)\n"
 #ifndef LOG4CXX_ENABLED
            "  -v, --verbose=CONFIG    configure verbosity\n"
@@ -274,6 +283,13 @@ void shutdown(int param)
     post_shutdown();
 }
 
+boost::function<void()> post_reload;
+void reload(int param)
+{
+    VLOG_WARN(lg, "Reloading on signal %d", param);
+    post_reload();
+}
+
 int main(int argc, char *argv[])
 {
     namespace fs = boost::filesystem;
@@ -291,6 +307,8 @@ int main(int argc, char *argv[])
     const char* pid_file = "/var/run/nox.pid";
     const char* info_file = "./nox.info";
     unsigned int n_threads = 1;
+    bool sharded = false;
+    bool pin_cpus = false;
 #ifdef UNRELIABLE_ENABLED
     bool reliable = true;
 #endif // UNRELIABLE_ENABLED
@@ -326,6 +344,8 @@ int main(int argc, char *argv[])
             {"libdir",      required_argument, 0, 'l'},
             {"pid",         required_argument, 0, 'p'},
             {"threads",     required_argument, 0, 't'},
+            {"sharded",     no_argument, 0, 's'},
+            {"affinity",    no_argument, 0, 'a'},
             {"info",        required_argument, 0, 'n'},
 #ifdef LOG4CXX_ENABLED
             {"verbose",     no_argument, 0, 'v'},
@@ -402,6 +422,14 @@ int main(int argc, char *argv[])
             n_threads = atoi(optarg);
             break;
 
+        case 's':
+            sharded = true;
+            break;
+
+        case 'a':
+            pin_cpus = true;
+            break;
+
         case 'V':
             hello(program_name);
             exit(EXIT_SUCCESS);
@@ -506,7 +534,8 @@ int main(int argc, char *argv[])
            event dispatcher and the DSO deployer. */
         Component_context* event_dispatcher_context =
             new Static_component_context(
-            boost::bind(&Event_dispatcher::instantiate, _1, n_threads),
+            boost::bind(&Event_dispatcher::instantiate, _1, n_threads,
+                        sharded, pin_cpus),
             typeid(Event_dispatcher).name(),
             "event-dispatcher",
             platform_config_path);
@@ -540,11 +569,19 @@ int main(int argc, char *argv[])
             dynamic_cast<Event_dispatcher*>(event_dispatcher_context->get_instance());
 
         Shutdown_event shutdown_event;
-        post_shutdown =
-                boost::bind(&Event_dispatcher::post, ed, shutdown_event);
+        void (Event_dispatcher::*post)(const Event&) = &Event_dispatcher::post;
+        post_shutdown = boost::bind(post, ed, shutdown_event);
         signal(SIGTERM, shutdown);
         signal(SIGINT, shutdown);
-        signal(SIGHUP, shutdown);
+        if (ed->has_handlers(Reload_event::static_get_name()))
+        {
+            post_reload = boost::bind(post, ed, Reload_event());
+            signal(SIGHUP, reload);
+        }
+        else
+        {
+            signal(SIGHUP, shutdown);
+        }
         signal(SIGABRT, shutdown);
 
         if (daemon_flag)